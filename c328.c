@@ -13,30 +13,156 @@
 #include <stdint.h>
 #include <string.h>
 #include <avr/io.h> 
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "clock.h"
 #include "c328.h"
 
-/* >10ms timeout at 300 hz */
+/* Timeout in ms for a response, and between bytes of a package */
 #define CMD_TIMEOUT (20)
 
 /* Wait longer for the camera to take the image and return DATA response */
-#define PIC_TIMEOUT (200)
+#define PIC_TIMEOUT (700)
 
-#define RXREADY (UCSR0A & (1 << RXC0))
+/* Attempts at each package before giving up */
+#define PKG_RETRIES (3)
 
-/* Receive buffer */
+/* After a failed transfer the next open drops to a slower rate. A
+ * faster rate is tried again after this many images open without one */
+#define RATE_RETRY (32)
+
+/* After an error, the line must be quiet this long (ms) before the
+ * next command, so the rest of a bad package isn't taken as the reply */
+#define QUIET_TIME (3)
+
+/* Camera baud rates, fastest first, and the UBRR0 value for each */
+#define UBRR(baud) (F_CPU / 16 / (baud) - 1)
+
+typedef struct {
+	uint16_t br;
+	uint8_t ubrr;
+} c3_rate_t;
+
+PROGMEM static const c3_rate_t rates[] = {
+	{ BR_115200, UBRR(115200) },
+	{ BR_57600,  UBRR(57600) },
+	{ BR_38400,  UBRR(38400) },
+	{ BR_28800,  UBRR(28800) },
+	{ BR_19200,  UBRR(19200) },
+	{ BR_14400,  UBRR(14400) },
+};
+
+#define RATES (sizeof(rates) / sizeof(c3_rate_t))
+
+static uint8_t rate = RATES - 1; /* The current rate, 14.4k at power up */
+static uint8_t rate_best = 0;    /* The fastest rate not known to fail  */
+static uint8_t rate_good = 0;    /* Images opened since the last failure */
+
+/* Received bytes are queued here by the interrupt, except packages */
+#define RXRING_LEN (32) /* Must be a power of 2 */
+static volatile uint8_t rxring[RXRING_LEN];
+static volatile uint8_t rxring_head = 0;
+static volatile uint8_t rxring_tail = 0;
+static volatile uint8_t rxring_over = 0; /* 1 = A byte was dropped */
+
+#define RXREADY (rxring_head != rxring_tail)
+
+/* Command responses */
+static uint8_t cmdbuf[6];
+
+/* Package buffer. When prefetching it is split in two, one half
+ * is being read while the next package arrives in the other */
 #define RXBUF_LEN (256)
 uint8_t rxbuf[RXBUF_LEN];
 uint16_t rxbuf_len = 0;
 
+#ifdef C3_PREFETCH
+#define PKG_LEN (RXBUF_LEN / 2)
+#else
+#define PKG_LEN (RXBUF_LEN)
+#endif
+
 /* Expected package size */
 static uint16_t pkg_len = 64; /* Default is 64 according to datasheet */
 
-/* Timeout counter */
-volatile static uint8_t timeout_clk = 0;
+/* State of the package being received. pkg_size is volatile to work
+ * around an apparent bug in avr-gcc -- discovered by ms7821 in
+ * #highaltitude */
+static uint8_t pkg_checksum;
+volatile static uint16_t pkg_size;
+static uint32_t pkg_timeout;
+static uint8_t *pkg_buf = rxbuf;
+
+/* While a package is expected the interrupt stores it straight into
+ * pkg_buf, so it can arrive while the CPU is busy with something else */
+static volatile uint8_t pkg_rx = 0;
+static volatile uint16_t pkg_rx_len;
+
+/* Raw frames have no packages, the pixels follow the DATA response
+ * and the whole frame is sent at once. While raw_rx is set the
+ * interrupt passes the ACK and DATA to rxring, then stores the pixels
+ * of the band window into rxbuf and lets the rest go by */
+static volatile uint8_t raw_rx = 0;
+static volatile uint8_t raw_hdr;
+static volatile uint16_t raw_left;
+static volatile uint16_t raw_y;
+static uint16_t raw_x;
+static uint8_t *raw_p;
+static uint16_t raw_width, raw_height;
+static uint16_t raw_x0, raw_x1, raw_y0, raw_y1;
+static uint32_t raw_timeout;
+static uint16_t raw_last;
+static char raw_wait = 0; /* 1 = A frame is being sent */
 
-inline void c3_tick(void)
+static void c3_settle(void);
+static char c3_poll_raw(void);
+
+ISR(USART0_RX_vect)
 {
-	if(timeout_clk) timeout_clk--;
+	uint8_t b = UDR0;
+	uint8_t next = (rxring_head + 1) & (RXRING_LEN - 1);
+	
+	if(pkg_rx)
+	{
+		if(pkg_rx_len < pkg_len) pkg_buf[pkg_rx_len++] = b;
+		return;
+	}
+	
+	if(raw_rx && !raw_hdr)
+	{
+		if(raw_y >= raw_y0 && raw_y < raw_y1 &&
+		   raw_x >= raw_x0 && raw_x < raw_x1) *(raw_p++) = b;
+		
+		if(++raw_x == raw_width)
+		{
+			raw_x = 0;
+			raw_y++;
+		}
+		
+		if(--raw_left == 0) raw_rx = 0;
+		return;
+	}
+	
+	if(raw_rx) raw_hdr--;
+	
+	/* Drop the byte if the buffer is full. Command replies have no
+	 * checksum, so flag it and c3_rx_poll() fails the reply */
+	if(next == rxring_tail)
+	{
+		rxring_over = 1;
+		return;
+	}
+	
+	rxring[rxring_head] = b;
+	rxring_head = next;
+}
+
+static uint8_t rx_byte(void)
+{
+	uint8_t b = rxring[rxring_tail];
+	rxring_tail = (rxring_tail + 1) & (RXRING_LEN - 1);
+	return(b);
 }
 
 static void tx_byte(uint8_t b)
@@ -48,27 +174,72 @@ static void tx_byte(uint8_t b)
 	UDR0 = b;
 }
 
-static uint8_t c3_rx(uint8_t timeout)
+/* Responses are read into cmdbuf without waiting. c3_rx_poll()
+ * returns 1 until the response is complete, then 0 or -1 on timeout */
+static uint8_t rx_len;
+static uint32_t rx_timeout;
+
+static void c3_rx_start(uint16_t timeout)
 {
-	rxbuf_len = 0;
-	
-	timeout_clk = timeout;
-	while(timeout_clk)
+	rx_len = 0;
+	rx_timeout = timeout_set(timeout);
+}
+
+static char c3_rx_poll(void)
+{
+	while(RXREADY)
 	{
-		if(!RXREADY) continue;
-		rxbuf[rxbuf_len++] = UDR0;
-		if(rxbuf_len == 6) break;
+		/* Skip anything before the start of the response */
+		cmdbuf[rx_len] = rx_byte();
+		if(rx_len == 0 && cmdbuf[0] != 0xAA) continue;
+		
+		/* A reply with a byte missing can't be trusted */
+		if(++rx_len == 6) return(rxring_over ? -1 : 0);
 	}
 	
-	if(rxbuf_len != 6) return(0); /* Timeout or incomplete response */
-	if(rxbuf[0] != 0xAA) return(0); /* All responses should begin 0xAA */
+	/* Timeout or incomplete response */
+	return(timeout_expired(rx_timeout) ? -1 : 1);
+}
+
+static uint8_t c3_rx(uint16_t timeout)
+{
+	char r;
+	
+	c3_rx_start(timeout);
+	while((r = c3_rx_poll()) == 1) clock_idle();
 	
 	/* Return the received command ID */
-	return(rxbuf[1]);
+	return(r == 0 ? cmdbuf[1] : 0);
+}
+
+static void c3_quiet(void)
+{
+	uint32_t t;
+	
+	/* Drop whatever the camera is still sending */
+	t = timeout_set(QUIET_TIME);
+	while(!timeout_expired(t))
+	{
+		if(!RXREADY)
+		{
+			clock_idle();
+			continue;
+		}
+		
+		rx_byte();
+		t = timeout_set(QUIET_TIME);
+	}
 }
 
 static void c3_tx(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4)
 {
+	/* Don't cut off a package that is still arriving */
+	c3_settle();
+	
+	/* Anything still unread is stale once a new command is sent */
+	rxring_tail = rxring_head;
+	rxring_over = 0;
+	
 	tx_byte(0xAA);
 	tx_byte(cmd);
 	tx_byte(a1);
@@ -77,53 +248,253 @@ static void c3_tx(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4)
 	tx_byte(a4);
 }
 
-static char c3_cmd(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4)
+/* Send a command, c3_cmd_poll() returns 1 until it is ACKed, then 0
+ * or -1 if it wasn't */
+static uint8_t cmd_sent;
+
+static void c3_cmd_start(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4)
 {
-	uint8_t r;
-	
 	c3_tx(cmd, a1, a2, a3, a4);
-	r = c3_rx(CMD_TIMEOUT);
+	cmd_sent = cmd;
+	c3_rx_start(CMD_TIMEOUT);
+}
+
+static char c3_cmd_poll(void)
+{
+	char r;
+	
+	if((r = c3_rx_poll()) == 1) return(1);
 	
 	/* Did we get an ACK for this command? */
-	if(r != CMD_ACK || rxbuf[2] != cmd) return(-1);
+	if(r != 0 || cmdbuf[1] != CMD_ACK || cmdbuf[2] != cmd_sent) return(-1);
 	
 	return(0);
 }
 
-void c3_init(void)
+static char c3_cmd(uint8_t cmd, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4)
+{
+	char r;
+	
+	c3_cmd_start(cmd, a1, a2, a3, a4);
+	while((r = c3_cmd_poll()) == 1) clock_idle();
+	
+	return(r);
+}
+
+static void c3_set_rate(uint8_t r)
 {
-	/* Do UART initialisation, port 0 @ 14.4k baud for 7.3728 MHz clock */
+	rate = r;
 	UBRR0H = 0;
-	UBRR0L = 31;
+	UBRR0L = pgm_read_byte(&rates[r].ubrr);
+}
+
+uint32_t c3_baud(void)
+{
+	return(F_CPU / 16 / (pgm_read_byte(&rates[rate].ubrr) + 1));
+}
+
+void c3_init(void)
+{
+	/* Do UART initialisation, port 0 @ 14.4k baud */
+	c3_set_rate(RATES - 1);
 	
-	/* Enable TX & RX */
-	UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+	/* Enable TX, RX and RX interrupt */
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	
 	/* 8-bit, no parity and 1 stop bit */
 	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
 }
 
+/* Send the SYNC command until the camera responds, up to 60 times.
+ * c3_sync_poll() returns 1 until it has, then 0 or -1 */
+static uint8_t sync_tries;
+static uint8_t sync_acked;
+
+static void c3_sync_start(void)
+{
+	sync_tries = 0;
+	sync_acked = 0;
+	c3_cmd_start(CMD_SYNC, 0, 0, 0, 0);
+}
+
+static char c3_sync_poll(void)
+{
+	char r;
+	
+	if(!sync_acked)
+	{
+		/* Wait for an ACK, it should be followed by a SYNC */
+		if((r = c3_cmd_poll()) == 1) return(1);
+		if(r == 0)
+		{
+			sync_acked = 1;
+			c3_rx_start(CMD_TIMEOUT);
+			return(1);
+		}
+	}
+	else
+	{
+		if((r = c3_rx_poll()) == 1) return(1);
+		if(r == 0 && cmdbuf[1] == CMD_SYNC)
+		{
+			/* ACK the SYNC and return success code */
+			c3_tx(CMD_ACK, CMD_SYNC, 0, 0, 0);
+			return(0);
+		}
+	}
+	
+	/* If we got here 60 times, the camera failed to sync. Panic */
+	if(++sync_tries == 60) return(-1);
+	
+	sync_acked = 0;
+	c3_cmd_start(CMD_SYNC, 0, 0, 0, 0);
+	
+	return(1);
+}
+
 char c3_sync(void)
 {
-	char i;
+	char r;
+	
+	c3_sync_start();
+	while((r = c3_sync_poll()) == 1) clock_idle();
 	
-	/* Send the SYNC command until the camera responds, up to 60 */
-	for(i = 0; i < 60; i++)
+	return(r);
+}
+
+void c3_request_sync(void)
+{
+	c3_sync_start();
+}
+
+char c3_poll_sync(void)
+{
+	return(c3_sync_poll());
+}
+
+/* Opening an image, one step for each command. The camera is synced,
+ * found at another rate if it doesn't answer, stepped up to the
+ * fastest rate that works, then set up to take the picture. Resuming
+ * waits for the line to go quiet and asks for the picture again */
+#define OPEN_SYNC      (0)
+#define OPEN_FIND      (1)
+#define OPEN_NEGOTIATE (2)
+#define OPEN_BAUD      (3)
+#define OPEN_BAUD_SYNC (4)
+#define OPEN_SETUP     (5)
+#define OPEN_PKG_SIZE  (6)
+#define OPEN_SNAPSHOT  (7)
+#define OPEN_PICTURE   (8)
+#define OPEN_DATA      (9)
+#define OPEN_QUIET     (10)
+#define OPEN_RESYNC    (11)
+
+static uint8_t open_state;
+static uint8_t open_pt;     /* Picture type, 0 to stop once connected */
+static uint8_t open_ct;     /* CT_JPEG or CT_8BIT_GRAY                */
+static uint8_t open_rr;
+static uint8_t open_jr;
+static uint8_t open_rate;   /* Rate being tried, or the one before    */
+static uint8_t open_resume; /* 1 = Resuming, 2 = and synced again     */
+static uint16_t open_id;    /* Package to resume from                 */
+static uint32_t open_quiet;
+
+static void c3_open_start(uint8_t state, uint8_t pt, uint8_t jr)
+{
+	open_state = state;
+	open_pt = pt;
+	open_ct = CT_JPEG;
+	open_rr = 0;
+	open_jr = jr;
+	open_resume = 0;
+	
+	if(state == OPEN_SYNC) c3_sync_start();
+}
+
+static char c3_poll_connect(void)
+{
+	uint16_t br;
+	char r;
+	
+	switch(open_state)
 	{
-		/* Send the sync and wait for an ACK */
-		if(c3_cmd(CMD_SYNC, 0, 0, 0, 0) != 0) continue;
+	case OPEN_SYNC:
+		if((r = c3_sync_poll()) == 1) return(1);
+		if(r == 0) break;
 		
-		/* ACK should be followed by a SYNC */
-		if(c3_rx(CMD_TIMEOUT) != CMD_SYNC) continue;
+		/* The camera isn't at the rate we expect, try each in turn */
+		open_rate = 0;
+		c3_set_rate(0);
+		c3_sync_start();
+		open_state = OPEN_FIND;
+		return(1);
+	
+	case OPEN_FIND:
+		if((r = c3_sync_poll()) == 1) return(1);
+		if(r == 0) break;
 		
-		/* ACK the SYNC and return success code */
-		c3_tx(CMD_ACK, CMD_SYNC, 0, 0, 0);
+		if(++open_rate == RATES) return(-1);
+		c3_set_rate(open_rate);
+		c3_sync_start();
+		return(1);
+	
+	case OPEN_BAUD:
+		if((r = c3_cmd_poll()) == 1) return(1);
+		if(r != 0) return(-1);
 		
-		return(0);
+		c3_set_rate(rate_best);
+		c3_sync_start();
+		open_state = OPEN_BAUD_SYNC;
+		return(1);
+	
+	case OPEN_BAUD_SYNC:
+		if((r = c3_sync_poll()) == 1) return(1);
+		if(r == 0) break;
+		
+		/* No good. Don't try a faster rate again, or stay at the
+		 * old rate if this was slower. Find the camera */
+		rate_best = (rate < open_rate ? rate + 1 : open_rate);
+		c3_set_rate(open_rate);
+		c3_sync_start();
+		open_state = OPEN_SYNC;
+		return(1);
+	}
+	
+	/* Step to the fastest rate that works, or down after a failure */
+	if(rate_best != rate)
+	{
+		open_rate = rate;
+		br = pgm_read_word(&rates[rate_best].br);
+		
+		/* The camera ACKs at the old rate, then switches */
+		c3_cmd_start(CMD_SET_BAUDRATE, br >> 8, br & 0xFF, 0, 0);
+		open_state = OPEN_BAUD;
+		return(1);
 	}
 	
-	/* If we got here, the camera failed to sync. Panic */
-	return(-1);
+	return(0);
+}
+
+static char c3_connect(uint8_t state)
+{
+	char r;
+	
+	c3_open_start(state, 0, 0);
+	while((r = c3_poll_connect()) == 1) clock_idle();
+	
+	return(r);
+}
+
+char c3_negotiate(void)
+{
+	return(c3_connect(OPEN_NEGOTIATE));
+}
+
+/* A transfer failed at this rate, the next open tries a slower one */
+static void c3_rate_failed(void)
+{
+	if(rate + 1 < RATES) rate_best = rate + 1;
+	rate_good = 0;
 }
 
 char c3_setup(uint8_t ct, uint8_t rr, uint8_t jr)
@@ -158,59 +529,87 @@ char c3_get_picture(uint8_t pt, uint16_t *length)
 	if(c3_rx(PIC_TIMEOUT) != CMD_DATA) return(-1);
 	
 	/* Get the file size from the DATA args */
-	*length = rxbuf[3] + (rxbuf[4] << 8);
+	*length = cmdbuf[3] + (cmdbuf[4] << 8);
 	
 	return(0);
 }
 
-char c3_get_package(uint16_t id, uint8_t **dst, uint16_t *length)
+void c3_request_package(uint16_t id)
 {
-	uint8_t checksum;
-	volatile uint16_t s;
-	/* s is volatile to work around an apparent bug in avr-gcc --
-	 * discovered by ms7821 in #highaltitude */
-	
 	rxbuf_len = 0;
-	checksum = 0;
-	s = pkg_len;
+	pkg_checksum = 0;
+	pkg_size = pkg_len;
 	
 	/* Get the package by sending an ACK */
+	pkg_rx_len = 0;
+	pkg_rx = 1;
 	c3_tx(CMD_ACK, 0, 0, id & 0xFF, id >> 8);
 	
 	/* The camera should immediatly start returning data */
-	timeout_clk = CMD_TIMEOUT;
-	while(timeout_clk && rxbuf_len < s)
+	pkg_timeout = timeout_set(CMD_TIMEOUT);
+}
+
+char c3_poll_package(uint8_t **dst, uint16_t *length)
+{
+	uint16_t n;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		if(!RXREADY) continue;
-		
-		/* Read the byte and update checksum */
-		rxbuf[rxbuf_len] = UDR0;
-		checksum += rxbuf[rxbuf_len++];
+		n = pkg_rx_len;
+	}
+	
+	/* Check whatever has arrived */
+	if(rxbuf_len < n) pkg_timeout = timeout_set(CMD_TIMEOUT);
+	
+	while(rxbuf_len < n && rxbuf_len < pkg_size)
+	{
+		/* Update checksum */
+		pkg_checksum += pkg_buf[rxbuf_len++];
 		
 		if(rxbuf_len == 4)
 		{
 			/* Get the actual length of the package */
-			s = rxbuf[2] + (rxbuf[3] << 8) + 6;
-			if(s > pkg_len) return(-1);
+			pkg_size = pkg_buf[2] + (pkg_buf[3] << 8) + 6;
+			if(pkg_size > pkg_len)
+			{
+				pkg_rx = 0;
+				return(-1);
+			}
 		}
-		
-		timeout_clk = CMD_TIMEOUT;
 	}
 	
-	/* Test for timeout or incomplete package */
-	if(rxbuf_len != s) return(-2);
+	if(rxbuf_len < pkg_size)
+	{
+		/* Still waiting, or timed out with an incomplete package */
+		if(!timeout_expired(pkg_timeout)) return(1);
+		pkg_rx = 0;
+		return(-2);
+	}
+	
+	pkg_rx = 0;
 	
 	/* Fix and test checksum */
-	checksum -= rxbuf[rxbuf_len - 2];
-	if(checksum != rxbuf[rxbuf_len - 2]) return(-3);
+	pkg_checksum -= pkg_buf[rxbuf_len - 2];
+	if(pkg_checksum != pkg_buf[rxbuf_len - 2]) return(-3);
 	
 	/* All done */
-	*dst = rxbuf;
+	*dst = pkg_buf;
 	*length = rxbuf_len;
 	
 	return(0);
 }
 
+char c3_get_package(uint16_t id, uint8_t **dst, uint16_t *length)
+{
+	char r;
+	
+	pkg_buf = rxbuf;
+	c3_request_package(id);
+	while((r = c3_poll_package(dst, length)) == 1) clock_idle();
+	
+	return(r);
+}
+
 char c3_finish_picture(void)
 {
 	c3_tx(CMD_ACK, 0, 0, 0xF0, 0xF0);
@@ -221,77 +620,381 @@ char c3_finish_picture(void)
 
 static uint16_t image_len;
 static uint16_t image_read;
+static uint8_t image_type = PT_SNAPSHOT;
 
 static uint8_t *package;
 static uint16_t package_len;
 static uint16_t package_id;
+static char package_wait; /* 1 = A package has been requested */
+static char package_err;
+static uint8_t package_tries;
 
-char c3_open(uint8_t jr)
+/* A package received while the last was still being read */
+static uint8_t *package_next;
+static uint16_t package_next_len;
+
+static void c3_reset(void)
 {
-	/* Open, setup and take the image */
-	if(c3_sync() != 0) return(-1);
-	if(c3_setup(CT_JPEG, 0, jr) != 0) return(-2);
-	if(c3_set_package_size(RXBUF_LEN) != 0) return(-3);
-	if(c3_snapshot(ST_JPEG, 0) != 0) return(-4);
-	if(c3_get_picture(PT_SNAPSHOT, &image_len) != 0) return(-5);
-	
 	image_read = 0;
 	package = NULL;
 	package_len = 0;
 	package_id = 0;
+	package_wait = 0;
+	package_next = NULL;
+	package_err = 0;
+}
+
+static char c3_pump(void)
+{
+	uint16_t n;
+	char r;
+	
+	if(!package_wait)
+	{
+		/* Is there a free buffer and anything left to request? */
+		if(package_next || package_err) return(package_err);
+#ifndef C3_PREFETCH
+		if(package_len > 0) return(0);
+#endif
+		
+		n = (image_len + pkg_len - 7) / (pkg_len - 6);
+		if(package_id >= n) return(0);
+		
+		/* Packages alternate between the two halves of the buffer */
+		pkg_buf = rxbuf;
+#ifdef C3_PREFETCH
+		if(package_id & 1) pkg_buf += PKG_LEN;
+#endif
+		
+		c3_request_package(package_id++);
+		package_wait = 1;
+		package_tries = 1;
+	}
+	
+	r = c3_poll_package(&package_next, &package_next_len);
+	if(r == 1) return(1);
+	
+	if(r != 0 && package_tries < PKG_RETRIES)
+	{
+		/* ACK the same package again, the camera resends it. It's
+		 * not in flight while the ACK is sent, or c3_tx() waits on it */
+		package_wait = 0;
+		c3_quiet();
+		c3_request_package(package_id - 1);
+		package_wait = 1;
+		package_tries++;
+		return(1);
+	}
+	
+	package_wait = 0;
+	if(r != 0)
+	{
+		/* Keep the error for c3_fetch(), later packages are no use */
+		package_next = NULL;
+		package_err = r;
+		c3_rate_failed();
+		return(r);
+	}
+	
+	/* Skip the package headers and checksum */
+	package_next += 4;
+	package_next_len -= 6;
 	
 	return(0);
 }
 
-char c3_close(void)
+static void c3_next(void)
 {
-	c3_finish_picture();
+	package = package_next;
+	package_len = package_next_len;
+	package_next = NULL;
+}
+
+char c3_busy(void)
+{
+	/* Any package in flight is kept for c3_fetch() */
+	if(package_wait && c3_pump() == 1) return(1);
+	
+	/* Let a raw frame finish, then ACK it */
+	if(raw_wait)
+	{
+		if(c3_poll_raw() == 1) return(1);
+		raw_wait = 0;
+		raw_rx = 0;
+		c3_tx(CMD_ACK, CMD_DATA, 0, 0x01, 0);
+	}
+	
 	return(0);
 }
 
-uint16_t c3_read(uint8_t *ptr, uint16_t length)
+static void c3_settle(void)
 {
-	uint16_t r; /* Number of bytes left to read */
+	while(c3_busy()) clock_idle();
+}
+
+/* Resuming, a GET_PICTURE that fails may be because the camera lost
+ * sync after an error. Sync and try once more */
+static char c3_open_failed(char r)
+{
+	if(open_resume == 1)
+	{
+		c3_rate_failed();
+		open_resume = 2;
+		c3_sync_start();
+		open_state = OPEN_RESYNC;
+		return(1);
+	}
 	
-	/* Don't read past the end of the image */
-	r = image_len - image_read;
-	if(length > r) length = r;
+	return(open_resume ? -1 : r);
+}
+
+void c3_request_open(uint8_t pt, uint8_t jr)
+{
+	c3_open_start(OPEN_SYNC, pt, jr);
+}
+
+char c3_request_resume(uint16_t id)
+{
+	/* A preview isn't kept, asking again would take a new one */
+	if(image_type != PT_SNAPSHOT) return(-3);
+	
+	open_state = OPEN_QUIET;
+	open_pt = image_type;
+	open_resume = 1;
+	open_id = id;
+	open_quiet = timeout_set(QUIET_TIME);
+	
+	return(0);
+}
+
+char c3_poll_open(void)
+{
+	char r;
 	
-	r = length;
-	while(r)
+	if(open_state <= OPEN_BAUD_SYNC)
 	{
-		if(package_len == 0)
+		if((r = c3_poll_connect()) != 0) return(r);
+		
+		/* Setup and take the image */
+		c3_cmd_start(CMD_INIT, 0, open_ct, open_rr, open_jr);
+		open_state = OPEN_SETUP;
+		return(1);
+	}
+	
+	if(open_state == OPEN_QUIET)
+	{
+		/* Drop whatever the camera is still sending */
+		while(RXREADY)
+		{
+			rx_byte();
+			open_quiet = timeout_set(QUIET_TIME);
+		}
+		
+		if(!timeout_expired(open_quiet)) return(1);
+		
+		/* Finish the current transfer and request the same snapshot */
+		c3_finish_picture();
+		c3_cmd_start(CMD_GET_PICTURE, open_pt, 0, 0, 0);
+		open_state = OPEN_PICTURE;
+		return(1);
+	}
+	
+	if(open_state == OPEN_RESYNC)
+	{
+		if((r = c3_sync_poll()) == 1) return(1);
+		if(r != 0) return(-1);
+		
+		c3_cmd_start(CMD_GET_PICTURE, open_pt, 0, 0, 0);
+		open_state = OPEN_PICTURE;
+		return(1);
+	}
+	
+	if(open_state == OPEN_DATA)
+	{
+		/* The camera should now send a DATA message */
+		if((r = c3_rx_poll()) == 1) return(1);
+		if(r != 0 || cmdbuf[1] != CMD_DATA) return(c3_open_failed(-5));
+		
+		/* Get the file size from the DATA args */
+		image_len = cmdbuf[3] + (cmdbuf[4] << 8);
+		image_type = open_pt;
+		c3_reset();
+		
+		if(open_resume)
 		{
-			char i = c3_get_package(package_id++, &package, &package_len);
-			if(i != 0) return(length - r);
-			
-			/* Skip the package headers and checksum */
-			package += 4;
-			package_len -= 6;
+			/* Carry on from the start of package open_id */
+			if((uint32_t) open_id * (pkg_len - 6) > image_len) return(-2);
+			package_id = open_id;
+			image_read = open_id * (pkg_len - 6);
+			return(0);
 		}
-		else
+		
+		/* Conditions change during a flight, try a faster rate again */
+		if(rate_best > 0 && ++rate_good == RATE_RETRY)
 		{
-			uint16_t b = r;
-			if(b > package_len) b = package_len;
-			
-			if(ptr)
-			{
-				memcpy(ptr, package, b);
-				ptr += b;
-			}
-			
-			package     += b;
-			package_len -= b;
-			
-			r -= b;
-			
-			image_read += b;
+			rate_best--;
+			rate_good = 0;
+		}
+		
+		return(0);
+	}
+	
+	/* A command that isn't ACKed fails with -2 (setup) to -5 (picture) */
+	if((r = c3_cmd_poll()) == 1) return(1);
+	if(r != 0) return(c3_open_failed(OPEN_SETUP - 2 - open_state));
+	
+	switch(open_state++)
+	{
+	case OPEN_SETUP:
+		if(open_ct != CT_JPEG)
+		{
+			/* Raw frames have no packages, the snapshot is enough */
+			c3_cmd_start(CMD_SNAPSHOT, ST_RAW, 0, 0, 0);
+			open_state = OPEN_SNAPSHOT;
+			break;
 		}
+		
+		c3_cmd_start(CMD_SET_PKG_SIZE, 0x08, PKG_LEN & 0xFF, PKG_LEN >> 8, 0);
+		break;
+	
+	case OPEN_PKG_SIZE:
+		pkg_len = PKG_LEN;
+		
+		if(open_pt == PT_SNAPSHOT)
+		{
+			c3_cmd_start(CMD_SNAPSHOT, ST_JPEG, 0, 0, 0);
+			break;
+		}
+		
+		/* A preview isn't a snapshot */
+		open_state++;
+	
+	case OPEN_SNAPSHOT:
+		if(open_ct != CT_JPEG) return(0);
+		
+		c3_cmd_start(CMD_GET_PICTURE, open_pt, 0, 0, 0);
+		break;
+	
+	case OPEN_PICTURE:
+		/* Wait longer for the camera to take the image */
+		c3_rx_start(PIC_TIMEOUT);
+		break;
 	}
 	
+	return(1);
+}
+
+static char c3_open_jpeg(uint8_t pt, uint8_t jr)
+{
+	char r;
+	
+	c3_request_open(pt, jr);
+	while((r = c3_poll_open()) == 1) clock_idle();
+	
+	return(r);
+}
+
+char c3_open(uint8_t jr)
+{
+	return(c3_open_jpeg(PT_SNAPSHOT, jr));
+}
+
+char c3_open_preview(uint8_t jr)
+{
+	return(c3_open_jpeg(PT_JPEG_PREVIEW, jr));
+}
+
+char c3_resume(uint16_t id)
+{
+	char r;
+	
+	if((r = c3_request_resume(id)) != 0) return(r);
+	while((r = c3_poll_open()) == 1) clock_idle();
+	
+	return(r);
+}
+
+char c3_rewind(void)
+{
+	return(c3_resume(0));
+}
+
+char c3_close(void)
+{
+	c3_finish_picture();
+	return(0);
+}
+
+char c3_fetch(void)
+{
+	char r;
+	
+	/* Move on to the next package once this one is read */
+	if(package_len == 0 && package_next) c3_next();
+	
+	/* Keep the next package coming */
+	r = c3_pump();
+	
+	/* It may have just arrived */
+	if(package_len == 0 && package_next)
+	{
+		c3_next();
+		r = c3_pump();
+	}
+	
+	/* Is there data ready, or nothing left to read? */
+	if(package_len > 0 || image_read >= image_len) return(0);
+	if(r < 0) return(r);
+	
+	/* Give up if nothing is on its way */
+	return(package_wait ? 1 : -1);
+}
+
+uint16_t c3_read_nb(uint8_t *ptr, uint16_t length)
+{
+	uint16_t r;
+	
+	/* Don't read past the end of the image or the package */
+	r = image_len - image_read;
+	if(length > r) length = r;
+	if(length > package_len) length = package_len;
+	
+	if(ptr) memcpy(ptr, package, length);
+	
+	package     += length;
+	package_len -= length;
+	image_read  += length;
+	
 	return(length);
 }
 
+uint16_t c3_read(uint8_t *ptr, uint16_t length)
+{
+	uint16_t r, b;
+	char i;
+	
+	for(r = 0; r < length && !c3_eof(); r += b)
+	{
+		/* Wait for the next package if needed */
+		while((i = c3_fetch()) == 1) clock_idle();
+		if(i != 0) break;
+		
+		b = c3_read_nb(ptr ? ptr + r : NULL, length - r);
+	}
+	
+	return(r);
+}
+
+uint16_t c3_tell(void)
+{
+	return(image_read);
+}
+
+uint16_t c3_package_id(void)
+{
+	return(image_read / (pkg_len - 6));
+}
+
 uint16_t c3_filesize(void)
 {
 	return(image_len);
@@ -302,3 +1005,156 @@ char c3_eof(void)
 	return(image_read >= image_len);
 }
 
+/****************** Raw frames ******************/
+
+static char c3_poll_raw(void)
+{
+	uint16_t n;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		n = raw_left;
+	}
+	
+	if(!raw_rx) return(0);
+	
+	/* Time out if the frame stops arriving */
+	if(n != raw_last)
+	{
+		raw_last = n;
+		raw_timeout = timeout_set(CMD_TIMEOUT);
+	}
+	
+	if(!timeout_expired(raw_timeout)) return(1);
+	
+	raw_rx = 0;
+	return(-2);
+}
+
+void c3_request_open_raw(uint8_t rr, uint16_t *width, uint16_t *height)
+{
+	/* Setup and take the image, only 8-bit grey is supported */
+	c3_open_start(OPEN_SYNC, PT_SNAPSHOT, SR_80x64);
+	open_ct = CT_8BIT_GRAY;
+	open_rr = rr;
+	
+	if(rr == PR_160x120)
+	{
+		raw_width  = 160;
+		raw_height = 120;
+	}
+	else
+	{
+		raw_width  = 80;
+		raw_height = 60;
+	}
+	
+	*width  = raw_width;
+	*height = raw_height;
+}
+
+char c3_open_raw(uint8_t rr, uint16_t *width, uint16_t *height)
+{
+	char r;
+	
+	c3_request_open_raw(rr, width, height);
+	while((r = c3_poll_open()) == 1) clock_idle();
+	
+	return(r);
+}
+
+/* A band is requested with GET_PICTURE, then the ACK and DATA
+ * responses are waited for before the pixels */
+#define BAND_ACK    (0)
+#define BAND_DATA   (1)
+#define BAND_PIXELS (2)
+
+static uint8_t band_state;
+
+char c3_request_band(uint16_t x, uint16_t y, uint8_t blocks)
+{
+	/* The last frame must be finished before asking for another */
+	c3_settle();
+	
+	/* Lines past the bottom of the frame repeat the last one */
+	if(y >= raw_height) y = raw_height - 1;
+	
+	raw_x0 = x;
+	raw_x1 = x + blocks * 8;
+	raw_y0 = y;
+	raw_y1 = y + 8;
+	if(raw_y1 > raw_height) raw_y1 = raw_height;
+	
+	raw_p = rxbuf;
+	raw_x = raw_y = 0;
+	raw_left = raw_width * raw_height;
+	raw_last = raw_left;
+	
+	/* The ACK and DATA responses come first */
+	raw_hdr = 12;
+	raw_rx = 1;
+	
+	c3_cmd_start(CMD_GET_PICTURE, PT_SNAPSHOT, 0, 0, 0);
+	band_state = BAND_ACK;
+	
+	return(0);
+}
+
+char c3_poll_band(uint8_t **dst)
+{
+	uint16_t y, stride;
+	uint8_t *p;
+	char r;
+	
+	if(band_state == BAND_ACK)
+	{
+		if((r = c3_cmd_poll()) == 1) return(1);
+		if(r != 0)
+		{
+			raw_rx = 0;
+			return(-1);
+		}
+		
+		/* Wait longer for the camera to take the image */
+		c3_rx_start(PIC_TIMEOUT);
+		band_state = BAND_DATA;
+		return(1);
+	}
+	
+	if(band_state == BAND_DATA)
+	{
+		if((r = c3_rx_poll()) == 1) return(1);
+		if(r != 0 || cmdbuf[1] != CMD_DATA ||
+		   cmdbuf[3] + (cmdbuf[4] << 8) != raw_width * raw_height)
+		{
+			raw_rx = 0;
+			return(-1);
+		}
+		
+		/* The pixels follow, c3_settle() lets the rest go by */
+		raw_wait = 1;
+		raw_timeout = timeout_set(CMD_TIMEOUT);
+		band_state = BAND_PIXELS;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		y = raw_y;
+	}
+	
+	/* Is the band complete? The rest of the frame follows */
+	r = c3_poll_raw();
+	if(y < raw_y1 && r != 0) return(r);
+	if(y < raw_y1) return(-3);
+	
+	/* Fill in any lines past the bottom of the frame */
+	stride = raw_x1 - raw_x0;
+	p = rxbuf + (raw_y1 - raw_y0) * stride;
+	for(y = raw_y1 - raw_y0; y < 8; y++, p += stride)
+		memcpy(p, p - stride, stride);
+	
+	*dst = rxbuf;
+	
+	return(0);
+}
+
@@ -88,22 +88,82 @@
 #define ERR_SEND_PICTURE_ERROR              0xF5
 #define ERR_SEND_COMMAND_ERROR              0xFF
 
-extern void inline c3_tick(void);
-
 extern void c3_init(void);
 extern char c3_sync(void);
 
+/* c3_sync() in two halves, c3_poll_sync() returns 1 until the camera
+ * has synced, then 0 or -1 */
+extern void c3_request_sync(void);
+extern char c3_poll_sync(void);
+
+/* Switch the camera and UART0 to the fastest rate that works. A rate
+ * that fails to sync, or whose transfers fail, is left for a slower one
+ * until RATE_RETRY more images have opened. c3_open() does this after
+ * syncing */
+extern char c3_negotiate(void);
+extern uint32_t c3_baud(void);
+
 extern char c3_setup(uint8_t ct, uint8_t rr, uint8_t jr);
 extern char c3_set_package_size(uint16_t s);
 extern char c3_snapshot(uint8_t st, uint16_t skip_frame);
 extern char c3_get_picture(uint8_t pt, uint16_t *length);
 extern char c3_get_package(uint16_t id, uint8_t **dst, uint16_t *length);
+
+/* c3_get_package() in two halves, c3_poll_package() returns 1 until
+ * the package has arrived, then 0 or a negative error */
+extern void c3_request_package(uint16_t id);
+extern char c3_poll_package(uint8_t **dst, uint16_t *length);
 extern char c3_finish_picture(void);
 
 extern char c3_open(uint8_t jr);
+
+/* c3_open() and c3_open_preview() in two halves, pt is PT_SNAPSHOT or
+ * PT_JPEG_PREVIEW. c3_poll_open() returns 1 until the picture is ready,
+ * then 0 or a negative error. It also completes c3_request_resume()
+ * and c3_request_open_raw() */
+extern void c3_request_open(uint8_t pt, uint8_t jr);
+extern char c3_poll_open(void);
+
+/* 1 while a package or raw frame is still arriving. The next command
+ * waits for it, tasks can wait on this first instead */
+extern char c3_busy(void);
+
+/* Open a JPEG preview instead of a snapshot, jr is SR_80x64 or
+ * SR_160x128 for a thumbnail. The camera doesn't keep previews, so
+ * one can't be resumed or rewound */
+extern char c3_open_preview(uint8_t jr);
+extern char c3_rewind(void);
 extern char c3_close(void);
 extern uint16_t c3_read(uint8_t *ptr, uint16_t length);
+
+/* Each package is requested up to three times before c3_fetch() fails.
+ * After that c3_resume() requests the snapshot again and continues
+ * from the start of package id, c3_package_id() is the package holding
+ * the next unread byte and c3_tell() the number of bytes read.
+ * c3_request_resume() does the same without waiting, it returns -3 at
+ * once for a preview */
+extern char c3_resume(uint16_t id);
+extern char c3_request_resume(uint16_t id);
+extern uint16_t c3_package_id(void);
+extern uint16_t c3_tell(void);
+
+/* Non-blocking reads. c3_fetch() returns 1 while the next package is
+ * on its way, then 0 when c3_read_nb() can return data (or at the end
+ * of the image) or a negative error */
+extern char c3_fetch(void);
+extern uint16_t c3_read_nb(uint8_t *ptr, uint16_t length);
 extern uint16_t c3_filesize(void);
 extern char c3_eof(void);
 
+/* Raw 8-bit grey snapshots, rr is PR_80x60 or PR_160x120. The camera
+ * sends the whole frame for each c3_request_band(), and the band of 8
+ * lines by blocks * 8 pixels at x, y is kept. c3_poll_band() returns 1
+ * until the band has arrived, then 0 or a negative error. Lines below
+ * the frame are copies of the last. The next command waits for the
+ * rest of the frame */
+extern char c3_open_raw(uint8_t rr, uint16_t *width, uint16_t *height);
+extern void c3_request_open_raw(uint8_t rr, uint16_t *width, uint16_t *height);
+extern char c3_request_band(uint16_t x, uint16_t y, uint8_t blocks);
+extern char c3_poll_band(uint8_t **dst);
+
 #endif
@@ -0,0 +1,101 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#include "config.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "clock.h"
+
+/* TIMER0 runs at F_CPU / 64. A millisecond isn't a whole number of
+ * timer ticks at 7.3728MHz (115.2), so the period is stretched by one
+ * tick often enough to keep the average exact */
+#define CLOCK_HZ   (F_CPU / 64)
+#define CLOCK_TOP  (CLOCK_HZ / 1000)
+#define CLOCK_FRAC (CLOCK_HZ % 1000)
+
+static volatile uint32_t ms = 0;
+
+/* Time spent asleep, sampled each millisecond */
+static volatile uint8_t asleep = 0;
+static volatile uint32_t idle_ms = 0;
+
+ISR(TIMER0_COMPA_vect)
+{
+#if CLOCK_FRAC > 0
+	static uint16_t frac = 0;
+	
+	/* OCR0A sets the length of the next period */
+	frac += CLOCK_FRAC;
+	if(frac >= 1000)
+	{
+		frac -= 1000;
+		OCR0A = CLOCK_TOP;
+	}
+	else OCR0A = CLOCK_TOP - 1;
+#endif
+	
+	ms++;
+	if(asleep) idle_ms++;
+}
+
+void clock_init(void)
+{
+	TCCR0A = _BV(WGM01); /* Mode 2, CTC */
+	TCCR0B = _BV(CS01) | _BV(CS00); /* prescaler 64 */
+	OCR0A = CLOCK_TOP - 1;
+	TIMSK0 = _BV(OCIE0A); /* Enable interrupt */
+}
+
+uint32_t clock_ms(void)
+{
+	uint32_t r;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		r = ms;
+	}
+	
+	return(r);
+}
+
+uint32_t timeout_set(uint16_t timeout_ms)
+{
+	/* The current millisecond is already partly gone */
+	return(clock_ms() + timeout_ms + 1);
+}
+
+char timeout_expired(uint32_t t)
+{
+	return((int32_t) (clock_ms() - t) >= 0);
+}
+
+void clock_idle(void)
+{
+	/* TIMER0 wakes us every millisecond, as do the RTTY timer and the
+	 * UART interrupts, so polled conditions are still checked often */
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	asleep = 1;
+	sleep_mode();
+	asleep = 0;
+}
+
+uint32_t clock_idle_ms(void)
+{
+	uint32_t r;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		r = idle_ms;
+	}
+	
+	return(r);
+}
+
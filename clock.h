@@ -0,0 +1,31 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifndef INC_CLOCK_H
+#define INC_CLOCK_H
+
+#include <stdint.h>
+
+extern void clock_init(void);
+
+/* Milliseconds since clock_init(), wraps after about 49 days */
+extern uint32_t clock_ms(void);
+
+/* Timeouts. timeout_set() returns a deadline at least timeout_ms
+ * milliseconds away, timeout_expired() is true once it has passed */
+extern uint32_t timeout_set(uint16_t timeout_ms);
+extern char timeout_expired(uint32_t t);
+
+/* Sleep in IDLE mode until the next interrupt, at most 1ms. Interrupts
+ * must be enabled. clock_idle_ms() is the time spent asleep so far */
+extern void clock_idle(void);
+extern uint32_t clock_idle_ms(void);
+
+#endif
+
@@ -13,5 +13,101 @@
 #define F_CPU     (7372800)       /* Ticks per second     */
 #define CALLSIGN  "hadie"         /* The mission callsign */
 #define RTTY_BAUD (300)           /* RTTY baud rate       */
+#define RTTY_STOPBITS (2)         /* 1, 1.5 or 2 stop bits */
+
+/* Uncomment to transmit MFSK instead of RTTY, with 4 or 8 tones at
+ * RTTY_BAUD symbols per second. The tone is set by the PWM level on
+ * PD7, MFSK_LEVEL for the lowest tone and MFSK_STEP between tones.
+ * MFSK_DEPTH is the interleaver depth, 1 = no interleaving */
+//#define MFSK     (4)
+#define MFSK_DEPTH (1)
+#define MFSK_LEVEL (96)
+#define MFSK_STEP  (16)
+
+/* The ground station hears the tones spaced by the symbol rate, up from
+ * MFSK_BASE_TONE Hz in audio sampled at MFSK_SAMPLE_RATE. The top tone
+ * must be below half the sample rate or it aliases */
+#define MFSK_BASE_TONE   (1000)
+#define MFSK_SAMPLE_RATE (8000)
+
+#if defined(MFSK) && (MFSK_DEPTH < 1 || MFSK_DEPTH > 255)
+#error "MFSK_DEPTH must be 1 to 255"
+#endif
+
+#if defined(MFSK) && MFSK_BASE_TONE + (MFSK - 1) * RTTY_BAUD >= MFSK_SAMPLE_RATE / 2
+#error "The top MFSK tone is too high for MFSK_SAMPLE_RATE, lower RTTY_BAUD"
+#endif
+
+/* Seconds between telemetry lines, while rising and while falling.
+ * Image packets fill the airtime in between */
+#define TLM_PERIOD         (20)
+#define TLM_PERIOD_DESCENT (10)
+
+/* Request the next camera package while the last is still being read.
+ * Packages are halved to 128 bytes so two fit in the receive buffer.
+ * Comment out to use a single 256 byte package at a time */
+#define C3_PREFETCH
+
+/* Uncomment to take raw 8-bit grey frames from the camera, PR_80x60 or
+ * PR_160x120, and encode them on board instead of using the camera's
+ * JPEG. Each band of 8 lines is a new copy of the frame from the camera,
+ * so the smaller size is much quicker. Snapshots are not scored */
+//#define IMG_RAW (PR_160x120)
+
+/* Up to IMG_TRIES snapshots are scanned before transmitting an image,
+ * the first to reach IMG_MIN_SCORE is sent. If none do the last is sent */
+#define IMG_TRIES     (3)
+#define IMG_MIN_SCORE (40)
+
+/* Thumbnails sent after each full image, from the camera's JPEG preview
+ * at THUMB_RES (SR_80x64 or SR_160x128). Each is a separate SSDV image
+ * of a few packets. Set THUMBS to 0 to disable */
+#define THUMBS    (1)
+#define THUMB_RES (SR_80x64)
+
+/* Uncomment SD_RECORD to store pictures on an SD card. Every
+ * SD_INTERVAL seconds a snapshot at SD_RES is stored, with another at
+ * SD_DOWNLINK and a thumbnail. The radio chooses from the SD_DOWNLINK
+ * pictures and the newest thumbnail instead of the camera. Without a
+ * card images come from the camera as before. Not with IMG_RAW */
+#define SD_RECORD
+#define SD_RES      (SR_640x480)
+#define SD_DOWNLINK (SR_320x240)
+#define SD_INTERVAL (10)
+
+/* With SD_RECORD, the last RETX_IMAGES images sent are repeated from
+ * the card RETX_PACKETS packets at a time whenever there's no new image
+ * to send, such as during descent. The least repeated image goes first.
+ * Set RETX_IMAGES to 0 to disable */
+#define RETX_IMAGES  (4)
+#define RETX_PACKETS (8)
+
+#if defined(SD_RECORD) && defined(IMG_RAW)
+#error "SD_RECORD can't be used with IMG_RAW"
+#endif
+
+/* Times reading an image from the camera may be resumed after an
+ * error, before the image is given up */
+#define IMG_RESUMES (3)
+
+/* Snapshots that differ from the last transmitted image by less than
+ * IMG_MIN_DIFF (mean difference in Y level) are skipped, but no more
+ * than IMG_MAX_SKIP in a row */
+#define IMG_MIN_DIFF (6)
+#define IMG_MAX_SKIP (5)
+
+/* RS codes in each image packet: 32, 16 or 8. Fewer codes leave more
+ * room for image data but correct fewer errors */
+#define SSDV_RSCODES (32)
+
+/* Image packets per repair group, and the number of repair packets
+ * sent after each group. Set SSDV_REPAIR to 0 to disable. Each repair
+ * packet needs SSDV_PKT_SIZE_REPAIR bytes of RAM */
+#define SSDV_GROUP  (16)
+#define SSDV_REPAIR (1)
+
+/* Uncomment to collect encoder statistics for each image, reported
+ * after it is sent */
+//#define SSDV_STATS
 
 #endif
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <avr/interrupt.h> 
+#include "clock.h"
 #include "gps.h"
 
 #ifdef UBLOX5
@@ -20,14 +21,6 @@
 
 /************* UART RX interrupt handler and buffer *************************/
 
-/* Timeout counter */
-volatile static uint8_t timeout_clk = 0;
-
-inline void gps_tick(void)
-{
-	if(timeout_clk) timeout_clk--;
-}
-
 /* The maximum length of the NMEA string is 82 characters */
 #define RXBUFSIZE (82 + 1)
 
@@ -310,9 +303,14 @@ PROGMEM const uint8_t ubx_setnav[] = {
 0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x16,0xDC
 };
 
+/* Timeout in ms for the ACK */
+#define UBX_TIMEOUT (1000)
+
 PROGMEM const uint8_t ubx_setnav_ack[] = { 0x05,0x01,0x02,0x00,0x06,0x24 };
 
-char gps_ubx_init(void)
+static uint32_t ubx_timeout;
+
+void gps_ubx_start(void)
 {
 	uint8_t i;
 	
@@ -322,12 +320,13 @@ char gps_ubx_init(void)
 	
 	/* Wait for a response */
 	ubx_want_packet = 1;
-	
-	timeout_clk = 255; /* 0.85 seconds at 300hz */
-	while(timeout_clk)
+	ubx_timeout = timeout_set(UBX_TIMEOUT);
+}
+
+char gps_ubx_poll(void)
+{
+	if(ubx_want_packet == 0)
 	{
-		if(ubx_want_packet == 1) continue;
-		
 		/* Got a packet... the ACK for the command? */
 		if(!memcmp_P((void *) &ubx_rx[2], ubx_setnav_ack, sizeof(ubx_setnav_ack)))
 		{
@@ -338,11 +337,23 @@ char gps_ubx_init(void)
 		ubx_want_packet = 1;
 	}
 	
+	if(!timeout_expired(ubx_timeout)) return(1);
+	
 	/* Timeout waiting for ACK packet */
 	ubx_want_packet = 0;
 	
 	return(-1);
 }
+
+char gps_ubx_init(void)
+{
+	char r;
+	
+	gps_ubx_start();
+	while((r = gps_ubx_poll()) == 1) clock_idle();
+	
+	return(r);
+}
 #endif
 
 void gps_init(void)
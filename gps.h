@@ -39,6 +39,11 @@ extern char gps_parse(gpsfix_t *gps);
 
 #ifdef UBLOX5
 extern char gps_ubx_init(void);
+
+/* gps_ubx_init() in two halves, gps_ubx_poll() returns 1 until the
+ * ACK arrives (0) or the timeout passes (-1) */
+extern void gps_ubx_start(void);
+extern char gps_ubx_poll(void);
 #endif
 
 #endif
@@ -13,85 +13,77 @@
 #include <util/delay.h>
 #include <util/crc16.h>
 #include <avr/interrupt.h>
+#include "clock.h"
+#include "pt.h"
 #include "rtty.h"
 #include "gps.h"
 #include "c328.h"
 #include "rs8.h"
 #include "ssdv.h"
+#include "sdlog.h"
 
-/* Message buffer */
+/* Message buffers. One is filled while the other is sent, msg points
+ * to the next one to fill */
 #define MSG_SIZE (100)
-char msg[MSG_SIZE];
+static char msgbuf[2][MSG_SIZE];
+static uint16_t msg_tx[2];
+static uint8_t msg_n = 0;
+char *msg = msgbuf[0];
 
 #define PREFIX "$$"
 
-/* Image TX data */
-uint8_t pkt[SSDV_PKT_SIZE], img[64];
+/* Wait until the next message buffer has been sent */
+#define msg_ready() rtx_done(msg_tx[msg_n])
+#define msg_wait() while(!msg_ready())
+
+/* Queue the message and move on to the other buffer */
+#define msg_send() do { \
+	msg_tx[msg_n] = rtx_string(msg); \
+	msg = msgbuf[msg_n ^= 1]; \
+} while(0)
+
+/* Image TX data. The next packet is encoded while the last is sent */
+uint8_t pkt[2][SSDV_PKT_SIZE], img[64];
+static uint16_t pkt_tx[2];
+static uint8_t pkt_n = 0;
+#if SSDV_REPAIR > 0
+uint8_t rpbuf[SSDV_REPAIR * SSDV_PKT_SIZE_REPAIR];
+#else
+#define rpbuf (NULL)
+#endif
 
 /* State of the flight */
 #define ALT_STEP (200)
 static int32_t r_altitude = 0; /* Reference altitude */
 static char ascent = 1; /* Direction of travel. 0 = Down, 1 = Up */
 
-char tx_image(void)
+#ifdef SSDV_STATS
+void tx_ssdv_stats(ssdv_t *s)
 {
-	static char setup = 0;
-	static uint8_t img_id = 0;
-	static ssdv_t ssdv;
-	int r;
+	ssdv_stats_t *st = &s->stats;
 	
-	if(!setup)
-	{
-		/* Don't begin transmitting a new image if the payload is falling */
-		if(ascent == 0) return(setup);
-		
-		if(c3_open(SR_320x240) != 0)
-		{
-			rtx_string_P(PSTR(PREFIX CALLSIGN ":Camera error\n"));
-			return(setup);
-		}
-		
-		setup = -1;
-		
-		ssdv_enc_init(&ssdv, CALLSIGN, img_id++);
-		ssdv_enc_set_buffer(&ssdv, pkt);
-	}
-	
-	while((r = ssdv_enc_get_packet(&ssdv)) == SSDV_FEED_ME)
-	{
-		size_t r = c3_read(img, 64);
-		if(r == 0) break;
-		ssdv_enc_feed(&ssdv, img, r);
-	}
-	
-	if(r != SSDV_OK)
-	{
-		/* Something went wrong! */
-		c3_close();
-		setup = 0;
-		rtx_string_P(PSTR(PREFIX CALLSIGN ":ssdv_enc_get_packet() failed\n"));
-		return(setup);
-	}
+	msg_wait();
+	snprintf_P(msg, MSG_SIZE,
+		PSTR(PREFIX CALLSIGN ":Image %u, %u+%u packets, %lu bytes, %u stuffing, %u pad bits, %u fill\n"),
+		s->image_id, st->packets, st->repair, st->in_bytes,
+		st->stuffing, st->pad_bits, st->fill_bytes);
+	msg_send();
 	
-	if(ssdv.state == S_EOI || c3_eof())
-	{
-		/* The end of the image has been reached */
-		c3_close();
-		setup = 0;
-	}
-	
-	/* Got the packet! Transmit it */
-	rtx_data(pkt, SSDV_PKT_SIZE);
-	
-	return(setup);
+	msg_wait();
+	snprintf_P(msg, MSG_SIZE,
+		PSTR(PREFIX CALLSIGN ":Coefs %lu/%lu/%lu, bits %lu/%lu/%lu, zeroed %lu\n"),
+		st->coefs[0], st->coefs[1], st->coefs[2],
+		st->bits[0], st->bits[1], st->bits[2], st->zeroed);
+	msg_send();
 }
+#endif
 
 uint16_t crccat(char *msg)
 {
 	uint16_t x;
 	for(x = 0xFFFF; *msg; msg++)
 		x = _crc_xmodem_update(x, *msg);
-	snprintf(msg, 8, "*%04X\n", x);
+	snprintf_P(msg, 8, PSTR("*%04X\n"), x);
 	return(x);
 }
 
@@ -103,9 +95,9 @@ char tx_telemetry(void)
 	/* Read the GPS data */
 	gps_parse(&gps);
 	
-	rtx_wait();
-	snprintf(msg, MSG_SIZE,
-		PREFIX CALLSIGN ",%u,%02i:%02i:%02i,%s%i.%06lu,%s%i.%06lu,%li,%i,%i,?",
+	msg_wait();
+	snprintf_P(msg, MSG_SIZE,
+		PSTR(PREFIX CALLSIGN ",%u,%02i:%02i:%02i,%s%i.%06lu,%s%i.%06lu,%li,%i,%i,?"),
 		counter++,
 		gps.hour, gps.minute, gps.second,
 		(gps.latitude_h == 'S' ? "-" : ""),
@@ -118,7 +110,7 @@ char tx_telemetry(void)
 	crccat(msg + 2);
 	
 	/* Begin transmitting */
-	rtx_string(msg);
+	msg_send();
 	
 	/* Update the ascent / descent status */
 	if(gps.fix > 0)
@@ -146,11 +138,771 @@ char tx_telemetry(void)
 	return(0);
 }
 
+/* Report the share of time the CPU has spent asleep since the last report */
+void tx_idle(void)
+{
+	static uint32_t last_ms = 0, last_idle = 0;
+	uint32_t now = clock_ms(), idle = clock_idle_ms();
+	
+	msg_wait();
+	snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":CPU idle %lu%%\n"),
+		(idle - last_idle) * 100 / (now - last_ms + 1));
+	msg_send();
+	
+	last_ms = now;
+	last_idle = idle;
+}
+
+/* Telemetry is due, or will be before another image packet queued
+ * behind the data already waiting could be sent */
+static uint32_t tlm_next = 0;
+#define tlm_due() ((int32_t) (clock_ms() + RTX_MS(rtx_pending() + SSDV_PKT_SIZE) - tlm_next) >= 0)
+
+/* Images are held back until the next telemetry line when one can't
+ * be started, so a failed camera isn't retried continuously */
+static char hold = 0;
+
+static char task_telemetry(pt_t *pt)
+{
+	PT_BEGIN(pt);
+	
+	while(1)
+	{
+		PT_WAIT_UNTIL(pt, tlm_due() && msg_ready());
+		
+		tx_telemetry();
+		
+		/* Lines are sent more often while falling */
+		tlm_next = clock_ms() + (ascent ? TLM_PERIOD : TLM_PERIOD_DESCENT) * 1000UL;
+		hold = 0;
+	}
+	
+	PT_END(pt);
+}
+
+/* Feed the next block of image data from the camera to the encoder.
+ * img_n is the number of bytes fed, 0 at the end or on error. After a
+ * camera error reading carries on from the same place, up to
+ * img_resumes times for each pass through the image */
+static uint16_t img_n;
+static uint8_t img_resumes;
+
+#ifdef IMG_RAW
+
+/* Raw frames are fed in bands of up to 4 blocks, left to right and top
+ * to bottom. A band that fails is requested again */
+static uint16_t raw_width, raw_height, band_x, band_y;
+
+static char task_feed_raw(pt_t *pt, ssdv_t *s)
+{
+	static uint8_t *band;
+	static uint8_t n;
+	static char r;
+	
+	PT_BEGIN(pt);
+	
+	n = (raw_width - band_x) / 8;
+	if(n > 4) n = 4;
+	
+	while(1)
+	{
+		/* The last frame must go by before the next is asked for */
+		PT_WAIT_UNTIL(pt, !c3_busy());
+		r = c3_request_band(band_x, band_y, n);
+		if(r == 0) PT_WAIT_UNTIL(pt, (r = c3_poll_band(&band)) != 1);
+		
+		if(r == 0 || img_resumes == 0) break;
+		img_resumes--;
+	}
+	
+	img_n = 0;
+	if(r == 0)
+	{
+		img_n = n * 64;
+		ssdv_enc_feed_raw(s, band, n, n * 8);
+		
+		if((band_x += n * 8) >= raw_width)
+		{
+			band_x = 0;
+			band_y += 8;
+		}
+	}
+	
+	PT_END(pt);
+}
+
+#endif
+
+/* Wait for the next data from the camera, resuming after errors.
+ * fetch_r is the result of c3_fetch() */
+static char fetch_r;
+
+static char task_fetch(pt_t *pt)
+{
+	static uint16_t pos;
+	
+	PT_BEGIN(pt);
+	
+	PT_WAIT_UNTIL(pt, (fetch_r = c3_fetch()) != 1);
+	
+	while(fetch_r < 0 && img_resumes > 0)
+	{
+		img_resumes--;
+		pos = c3_tell();
+		if(c3_request_resume(c3_package_id()) != 0) continue;
+		PT_WAIT_UNTIL(pt, (fetch_r = c3_poll_open()) != 1);
+		if(fetch_r != 0) continue;
+		
+		/* Skip the part of the package already read */
+		do
+		{
+			PT_WAIT_UNTIL(pt, (fetch_r = c3_fetch()) != 1);
+			if(fetch_r == 0) c3_read_nb(NULL, pos - c3_tell());
+		}
+		while(fetch_r == 0 && c3_tell() < pos);
+	}
+	
+	PT_END(pt);
+}
+
+static char task_feed(pt_t *pt, ssdv_t *s)
+{
+	static pt_t pt_fetch;
+	
+	PT_BEGIN(pt);
+	
+	PT_SPAWN(pt, &pt_fetch, task_fetch(&pt_fetch));
+	
+	img_n = 0;
+	if(fetch_r == 0 && !c3_eof())
+	{
+		img_n = c3_read_nb(img, 64);
+		ssdv_enc_feed(s, img, img_n);
+	}
+	
+	PT_END(pt);
+}
+
+#ifdef SD_RECORD
+
+/* With a card, task_capture() stores every picture from the camera and
+ * the radio sends a selection of them back from the card. sd_ok is 0
+ * if the card didn't start, then images come straight from the camera */
+static char sd_ok = 0;
+static uint16_t sd_id = 0;      /* ID of the next stored capture */
+static uint16_t sd_errors = 0;  /* Captures not stored          */
+
+/* The stored record being fed to the encoder, and the next byte */
+static sdlog_rec_t sd_rec;
+static uint32_t sd_pos;
+
+static char task_feed_sd(pt_t *pt, ssdv_t *s)
+{
+	PT_BEGIN(pt);
+	
+	/* The card can't be read while a picture is being stored */
+	PT_WAIT_UNTIL(pt, !sdlog_busy());
+	
+	img_n = sizeof(img);
+	if(sd_rec.length - sd_pos < img_n) img_n = sd_rec.length - sd_pos;
+	if(img_n > 0 && sdlog_read(&sd_rec, sd_pos, img, img_n) != 0) img_n = 0;
+	
+	if(img_n > 0)
+	{
+		sd_pos += img_n;
+		ssdv_enc_feed(s, img, img_n);
+	}
+	
+	PT_END(pt);
+}
+
+/* Take a picture of type pic (PT_SNAPSHOT or PT_JPEG_PREVIEW) at jr
+ * and copy it to a new record of type. sd_r is 0 once it is stored */
+static uint8_t sd_buf[32];
+static char sd_r;
+
+static char task_store(pt_t *pt, uint8_t type, uint8_t pic, uint8_t jr)
+{
+	static pt_t pt_fetch;
+	
+	PT_BEGIN(pt);
+	
+	c3_request_open(pic, jr);
+	PT_WAIT_UNTIL(pt, (sd_r = c3_poll_open()) != 1);
+	
+	img_resumes = IMG_RESUMES;
+	if(sd_r == 0) sd_r = sdlog_begin(type, sd_id, c3_filesize());
+	
+	while(sd_r == 0 && !c3_eof())
+	{
+		PT_SPAWN(pt, &pt_fetch, task_fetch(&pt_fetch));
+		if((sd_r = fetch_r) != 0) break;
+		
+		sd_r = sdlog_write(sd_buf, c3_read_nb(sd_buf, sizeof(sd_buf)));
+	}
+	
+	if(sd_r == 0) sd_r = sdlog_end();
+	else if(sdlog_busy()) sdlog_cancel();
+	
+	c3_close();
+	
+	PT_END(pt);
+}
+
+/* Every SD_INTERVAL seconds store a snapshot at SD_RES, another at
+ * SD_DOWNLINK for the radio and a thumbnail, all with the same ID */
+static char task_capture(pt_t *pt)
+{
+	static pt_t pt_store;
+	static uint32_t next = 0;
+	
+	PT_BEGIN(pt);
+	
+	while(1)
+	{
+		PT_WAIT_UNTIL(pt, (int32_t) (clock_ms() - next) >= 0);
+		next = clock_ms() + SD_INTERVAL * 1000UL;
+		
+		PT_SPAWN(pt, &pt_store, task_store(&pt_store, SDLOG_IMAGE, PT_SNAPSHOT, SD_RES));
+		
+		if(sd_r == 0)
+			PT_SPAWN(pt, &pt_store, task_store(&pt_store, SDLOG_DOWNLINK, PT_SNAPSHOT, SD_DOWNLINK));
+		
+#if THUMBS > 0
+		if(sd_r == 0)
+			PT_SPAWN(pt, &pt_store, task_store(&pt_store, SDLOG_THUMB, PT_JPEG_PREVIEW, THUMB_RES));
+#endif
+		
+		/* The parts stored before a failure stay on the card, so
+		 * the next capture gets a new ID either way */
+		if(sd_r != 0) sd_errors++;
+		sd_id++;
+	}
+	
+	PT_END(pt);
+}
+
+/* Follow the log as it grows. The last IMG_TRIES downlink images not
+ * yet considered are kept in sd_try, and the newest thumbnail */
+static sdlog_rec_t sd_cur, sd_try[IMG_TRIES], sd_thumb;
+static uint8_t sd_tries = 0;
+static uint32_t sd_seen = 0;
+static char sd_started = 0, sd_thumb_new = 0;
+
+static void sd_follow(void)
+{
+	while((sd_started ? sdlog_next(&sd_cur) : sdlog_first(&sd_cur)) == 0)
+	{
+		sd_started = 1;
+		
+		if(sd_cur.type == SDLOG_DOWNLINK)
+		{
+			if(sd_tries == IMG_TRIES)
+			{
+				memmove(&sd_try[0], &sd_try[1], sizeof(sdlog_rec_t) * (IMG_TRIES - 1));
+				sd_tries--;
+			}
+			
+			sd_try[sd_tries++] = sd_cur;
+		}
+		else if(sd_cur.type == SDLOG_THUMB)
+		{
+			sd_thumb = sd_cur;
+			sd_thumb_new = 1;
+		}
+	}
+	
+	sd_seen = sdlog_count();
+}
+
+#endif
+
+/* Encode and transmit the image being fed to s. img_r is the last
+ * result of ssdv_enc_get_packet(), SSDV_EOI once it has all gone or
+ * SSDV_FEED_ME if the data ran out first, at the end or on an error.
+ * Only packets pkt_from to pkt_to - 1 are sent, if the range ends
+ * before the image img_r is left at SSDV_OK */
+static char img_r;
+static uint16_t pkt_from = 0, pkt_to = 0xFFFF;
+
+static char task_send(pt_t *pt, ssdv_t *s)
+{
+	static pt_t pt_feed;
+	static uint16_t id;
+	
+	PT_BEGIN(pt);
+	
+	while(1)
+	{
+		/* Encode into whichever buffer isn't being sent */
+		PT_WAIT_UNTIL(pt, rtx_done(pkt_tx[pkt_n]));
+		ssdv_enc_set_buffer(s, pkt[pkt_n]);
+		
+		while((img_r = ssdv_enc_get_packet(s)) == SSDV_FEED_ME)
+		{
+#ifdef IMG_RAW
+			if(s->raw) PT_SPAWN(pt, &pt_feed, task_feed_raw(&pt_feed, s));
+			else
+#endif
+#ifdef SD_RECORD
+			if(sd_ok) PT_SPAWN(pt, &pt_feed, task_feed_sd(&pt_feed, s));
+			else
+#endif
+			PT_SPAWN(pt, &pt_feed, task_feed(&pt_feed, s));
+			if(img_n == 0) break;
+		}
+		
+		if(img_r != SSDV_OK) break;
+		
+		id = s->packet_id - 1;
+		if(id < pkt_from) continue;
+		if(id >= pkt_to) break;
+		
+		/* Let any telemetry that's due go first */
+		PT_WAIT_UNTIL(pt, !tlm_due());
+		
+		/* Got the packet! Transmit it */
+		pkt_tx[pkt_n] = rtx_data(pkt[pkt_n], SSDV_PKT_SIZE);
+		pkt_n ^= 1;
+		
+		/* The camera goes to sleep while transmitting telemetry,
+		 * sync'ing here seems to prevent it. The packet is already
+		 * queued, so this happens while it is sent. A prefetched
+		 * package is let in first and kept. The camera is left
+		 * alone while task_capture() is using it */
+#ifdef SD_RECORD
+		if(!sd_ok)
+#endif
+		{
+			PT_WAIT_UNTIL(pt, !c3_busy());
+			c3_request_sync();
+			PT_WAIT_UNTIL(pt, c3_poll_sync() != 1);
+		}
+		rtx_string_P(PSTR("\n"));
+	}
+	
+	PT_END(pt);
+}
+
+uint32_t image_score(ssdv_t *s)
+{
+	if(s->scan.dc_n == 0) return(0);
+	
+	/* The detail in the image: the mean AC energy of each Y block,
+	 * plus the variance of the Y block levels. Dark or blurred
+	 * images score low */
+	return(s->scan.ac_energy / s->scan.dc_n + ssdv_scan_dc_variance(s) / 64);
+}
+
+/* There's only RAM for one encoder, shared by either image task */
+static ssdv_t ssdv;
+static uint8_t img_id = 0;
+#ifndef IMG_RAW
+static uint8_t last_sig[SSDV_SIG_LEN];
+static uint8_t skipped = IMG_MAX_SKIP;
+#endif
+
+static char task_image(pt_t *pt)
+{
+	static pt_t pt_send;
+#if THUMBS > 0
+	static uint8_t thumb;
+#endif
+#ifndef IMG_RAW
+	static pt_t pt_feed;
+	static uint8_t i, diff;
+	static uint32_t score, fetch;
+#endif
+	static char r;
+	
+	PT_BEGIN(pt);
+	
+	while(1)
+	{
+		/* Put UBLOX5 GPS in proper nav mode */
+		gps_ubx_start();
+		PT_WAIT_UNTIL(pt, (r = gps_ubx_poll()) != 1);
+		if(r != 0) rtx_string_P(PSTR(PREFIX CALLSIGN ":GPS mode set failed\n"));
+		
+		/* Don't begin transmitting a new image if the payload is falling */
+		PT_WAIT_UNTIL(pt, !hold && ascent);
+		
+		/* The camera is opened while telemetry carries on. Each
+		 * command first waits for any data still arriving */
+		PT_WAIT_UNTIL(pt, !c3_busy());
+		
+#ifdef IMG_RAW
+		c3_request_open_raw(IMG_RAW, &raw_width, &raw_height);
+		PT_WAIT_UNTIL(pt, (r = c3_poll_open()) != 1);
+		if(r != 0)
+		{
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Camera error\n"));
+			hold = 1;
+			continue;
+		}
+		
+		band_x = band_y = 0;
+#else
+		/* Up to IMG_TRIES snapshots are scanned, the first detailed
+		 * enough is sent */
+		for(i = 1; ; i++)
+		{
+			c3_request_open(PT_SNAPSHOT, SR_320x240);
+			PT_WAIT_UNTIL(pt, (r = c3_poll_open()) != 1);
+			if(r != 0) break;
+			img_resumes = IMG_RESUMES;
+			
+			/* Time the fetch, to see the camera rate at work */
+			fetch = clock_ms();
+			
+			ssdv_scan_init(&ssdv);
+			while(ssdv_scan(&ssdv) == SSDV_FEED_ME)
+			{
+				PT_SPAWN(pt, &pt_feed, task_feed(&pt_feed, &ssdv));
+				if(img_n == 0) break;
+			}
+			
+			fetch = clock_ms() - fetch;
+			
+			score = image_score(&ssdv);
+			if(score >= IMG_MIN_SCORE || i >= IMG_TRIES) break;
+			
+			PT_WAIT_UNTIL(pt, !c3_busy());
+			c3_close();
+		}
+		
+		if(r != 0)
+		{
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Camera error\n"));
+			hold = 1;
+			continue;
+		}
+		
+		/* How much has the scene changed since the last image? */
+		diff = ssdv_sig_diff(ssdv.scan.sig, last_sig);
+		
+		PT_WAIT_UNTIL(pt, msg_ready());
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":Image score %lu, %lu bytes, diff %u (%u/%u)\n"),
+			score, ssdv.scan.bytes, diff, i, IMG_TRIES);
+		msg_send();
+		
+		PT_WAIT_UNTIL(pt, msg_ready());
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":Fetched %u bytes in %lu ms at %lu baud\n"),
+			c3_filesize(), fetch, c3_baud());
+		msg_send();
+		
+		if(diff < IMG_MIN_DIFF && skipped < IMG_MAX_SKIP)
+		{
+			/* Too similar to the last image, don't send it */
+			PT_WAIT_UNTIL(pt, !c3_busy());
+			c3_close();
+			skipped++;
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Image unchanged, skipped\n"));
+			hold = 1;
+			continue;
+		}
+		
+		memcpy(last_sig, ssdv.scan.sig, SSDV_SIG_LEN);
+		skipped = 0;
+		
+		/* The camera only keeps the last snapshot, read it again */
+		PT_WAIT_UNTIL(pt, !c3_busy());
+		if((r = c3_request_resume(0)) == 0)
+			PT_WAIT_UNTIL(pt, (r = c3_poll_open()) != 1);
+		
+		if(r != 0)
+		{
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Camera error\n"));
+			hold = 1;
+			continue;
+		}
+#endif
+		
+		img_resumes = IMG_RESUMES;
+		ssdv_enc_init(&ssdv, CALLSIGN, img_id++);
+		ssdv_enc_set_rscodes(&ssdv, SSDV_RSCODES);
+		ssdv_enc_set_repair(&ssdv, rpbuf, SSDV_GROUP, SSDV_REPAIR);
+#ifdef IMG_RAW
+		/* Padded out to a whole number of MCUs */
+		ssdv_enc_set_raw(&ssdv, raw_width, (raw_height + 15) & ~15);
+#endif
+		
+		PT_SPAWN(pt, &pt_send, task_send(&pt_send, &ssdv));
+		PT_WAIT_UNTIL(pt, !c3_busy());
+		c3_close();
+		
+		if(img_r == SSDV_EOI)
+		{
+			/* The end of the image has been reached, and any
+			 * repair packets for the last group have been sent */
+#ifdef SSDV_STATS
+			tx_ssdv_stats(&ssdv);
+#endif
+			PT_WAIT_UNTIL(pt, msg_ready());
+			tx_idle();
+		}
+		else if(img_r == SSDV_FEED_ME && !ssdv.raw && c3_eof())
+		{
+			/* The camera data ran out before the last MCU,
+			 * the JPEG was cut short */
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Image ended early\n"));
+		}
+		else rtx_string_P(PSTR(PREFIX CALLSIGN ":ssdv_enc_get_packet() failed\n"));
+		
+#if THUMBS > 0
+		/* Thumbnails from the camera's preview, each its own image */
+		for(thumb = 0; thumb < THUMBS; thumb++)
+		{
+			c3_request_open(PT_JPEG_PREVIEW, THUMB_RES);
+			PT_WAIT_UNTIL(pt, (r = c3_poll_open()) != 1);
+			if(r != 0)
+			{
+				rtx_string_P(PSTR(PREFIX CALLSIGN ":Camera error\n"));
+				break;
+			}
+			
+			img_resumes = IMG_RESUMES;
+			ssdv_enc_init(&ssdv, CALLSIGN, img_id++);
+			ssdv_enc_set_rscodes(&ssdv, SSDV_RSCODES);
+			ssdv_enc_set_repair(&ssdv, rpbuf, SSDV_GROUP, SSDV_REPAIR);
+			
+			PT_SPAWN(pt, &pt_send, task_send(&pt_send, &ssdv));
+			PT_WAIT_UNTIL(pt, !c3_busy());
+			c3_close();
+			
+			if(img_r != SSDV_EOI) break;
+		}
+#endif
+	}
+	
+	PT_END(pt);
+}
+
+#ifdef SD_RECORD
+
+/* Start a new SSDV image of sd_rec, read from the card */
+static void sd_enc_init(void)
+{
+	sd_pos = 0;
+	ssdv_enc_init(&ssdv, CALLSIGN, img_id++);
+	ssdv_enc_set_rscodes(&ssdv, SSDV_RSCODES);
+	ssdv_enc_set_repair(&ssdv, rpbuf, SSDV_GROUP, SSDV_REPAIR);
+}
+
+#if RETX_IMAGES > 0
+
+/* The last RETX_IMAGES images sent from the card, oldest first. Each
+ * is repeated RETX_PACKETS packets at a time from next, with the same
+ * SSDV image ID so the receivers can fill in what they lost */
+typedef struct
+{
+	sdlog_rec_t rec;
+	uint8_t image_id;
+	uint8_t passes;  /* Times it has been repeated in full */
+	uint16_t next;   /* Next packet to repeat              */
+} retx_t;
+
+static retx_t retx[RETX_IMAGES];
+static uint8_t retx_n = 0;
+static char retx_sent;  /* 1 if task_retx() had an image to repeat */
+
+static void retx_add(uint8_t image_id)
+{
+	if(retx_n == RETX_IMAGES)
+	{
+		memmove(&retx[0], &retx[1], sizeof(retx_t) * (RETX_IMAGES - 1));
+		retx_n--;
+	}
+	
+	retx[retx_n].rec = sd_rec;
+	retx[retx_n].image_id = image_id;
+	retx[retx_n].passes = 0;
+	retx[retx_n].next = 0;
+	retx_n++;
+}
+
+/* Repeat part of the image repeated least, the newest first */
+static char task_retx(pt_t *pt)
+{
+	static pt_t pt_send;
+	static retx_t *e;
+	uint8_t i;
+	
+	PT_BEGIN(pt);
+	
+	retx_sent = 0;
+	e = NULL;
+	for(i = retx_n; i > 0; i--)
+		if(e == NULL || retx[i - 1].passes < e->passes) e = &retx[i - 1];
+	
+	if(e != NULL)
+	{
+		retx_sent = 1;
+		
+		PT_WAIT_UNTIL(pt, msg_ready());
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":Repeating image %u from packet %u\n"),
+			e->image_id, e->next);
+		msg_send();
+		
+		/* Without repair packets the image packets are as before */
+		sd_rec = e->rec;
+		sd_pos = 0;
+		ssdv_enc_init(&ssdv, CALLSIGN, e->image_id);
+		ssdv_enc_set_rscodes(&ssdv, SSDV_RSCODES);
+		
+		pkt_from = e->next;
+		pkt_to = e->next + RETX_PACKETS;
+		PT_SPAWN(pt, &pt_send, task_send(&pt_send, &ssdv));
+		pkt_from = 0;
+		pkt_to = 0xFFFF;
+		
+		if(img_r == SSDV_OK) e->next += RETX_PACKETS;
+		else
+		{
+			/* Round again from the start, a failed image too */
+			e->next = 0;
+			if(e->passes < 0xFF) e->passes++;
+		}
+	}
+	
+	PT_END(pt);
+}
+
+#endif
+
+/* As task_image(), but choosing from the pictures stored on the card */
+static char task_image_sd(pt_t *pt)
+{
+	static pt_t pt_send, pt_feed;
+#if RETX_IMAGES > 0
+	static pt_t pt_retx;
+#endif
+	static uint8_t i, diff;
+	static uint32_t score;
+	static char r;
+	
+	PT_BEGIN(pt);
+	
+	while(1)
+	{
+		/* Put UBLOX5 GPS in proper nav mode */
+		gps_ubx_start();
+		PT_WAIT_UNTIL(pt, (r = gps_ubx_poll()) != 1);
+		if(r != 0) rtx_string_P(PSTR(PREFIX CALLSIGN ":GPS mode set failed\n"));
+		
+		/* Wait for new pictures to be stored. A new image isn't begun
+		 * if the payload is falling, the airtime until one can be is
+		 * used to repeat the last images sent */
+		while(1)
+		{
+			PT_WAIT_UNTIL(pt, !sdlog_busy());
+			if(sdlog_count() != sd_seen) sd_follow();
+			if(!hold && ascent && sd_tries > 0) break;
+			
+#if RETX_IMAGES > 0
+			PT_SPAWN(pt, &pt_retx, task_retx(&pt_retx));
+			if(retx_sent) continue;
+#endif
+			
+			PT_WAIT_UNTIL(pt, sdlog_count() != sd_seen || (!hold && ascent && sd_tries > 0));
+		}
+		
+		/* Scan the new pictures from the oldest, the first detailed
+		 * enough is sent */
+		for(i = 0; i < sd_tries; i++)
+		{
+			sd_rec = sd_try[i];
+			sd_pos = 0;
+			
+			ssdv_scan_init(&ssdv);
+			while(ssdv_scan(&ssdv) == SSDV_FEED_ME)
+			{
+				PT_SPAWN(pt, &pt_feed, task_feed_sd(&pt_feed, &ssdv));
+				if(img_n == 0) break;
+			}
+			
+			score = image_score(&ssdv);
+			if(score >= IMG_MIN_SCORE || i + 1 >= sd_tries) break;
+		}
+		
+		sd_tries = 0;
+		diff = ssdv_sig_diff(ssdv.scan.sig, last_sig);
+		
+		PT_WAIT_UNTIL(pt, msg_ready());
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":Image score %lu, %lu bytes, diff %u (%u/%u)\n"),
+			score, ssdv.scan.bytes, diff, i + 1, IMG_TRIES);
+		msg_send();
+		
+		if(diff < IMG_MIN_DIFF && skipped < IMG_MAX_SKIP)
+		{
+			/* Too similar to the last image, don't send it */
+			skipped++;
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Image unchanged, skipped\n"));
+			hold = 1;
+			continue;
+		}
+		
+		memcpy(last_sig, ssdv.scan.sig, SSDV_SIG_LEN);
+		skipped = 0;
+		
+		/* Which stored picture this is, for finding it on the card */
+		PT_WAIT_UNTIL(pt, msg_ready());
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":Image %u is stored %u, %lu records, %u errors\n"),
+			img_id, sd_rec.id, sdlog_count(), sd_errors);
+		msg_send();
+		
+		sd_enc_init();
+		PT_SPAWN(pt, &pt_send, task_send(&pt_send, &ssdv));
+		
+		if(img_r == SSDV_EOI)
+		{
+#if RETX_IMAGES > 0
+			retx_add(ssdv.image_id);
+#endif
+#ifdef SSDV_STATS
+			tx_ssdv_stats(&ssdv);
+#endif
+			PT_WAIT_UNTIL(pt, msg_ready());
+			tx_idle();
+		}
+		else if(img_r == SSDV_FEED_ME && sd_pos >= sd_rec.length)
+		{
+			/* The stored JPEG ran out before the last MCU */
+			rtx_string_P(PSTR(PREFIX CALLSIGN ":Image ended early\n"));
+		}
+		else rtx_string_P(PSTR(PREFIX CALLSIGN ":ssdv_enc_get_packet() failed\n"));
+		
+#if THUMBS > 0
+		/* The newest thumbnail on the card, a picture taken since
+		 * the one above was stored */
+		PT_WAIT_UNTIL(pt, !sdlog_busy());
+		sd_follow();
+		
+		if(sd_thumb_new)
+		{
+			sd_thumb_new = 0;
+			sd_rec = sd_thumb;
+			
+			sd_enc_init();
+			PT_SPAWN(pt, &pt_send, task_send(&pt_send, &ssdv));
+		}
+#endif
+	}
+	
+	PT_END(pt);
+}
+
+#endif
+
 int main(void)
 {
-	char r;
+	static pt_t pt_tlm, pt_img;
+#ifdef SD_RECORD
+	static pt_t pt_cap;
+#endif
 	
 	/* Initalise the various bits */
+	clock_init();
 	rtx_init();
 	gps_init();
 	c3_init();
@@ -162,26 +914,42 @@ int main(void)
 	/* Start interrupts and enter the main loop */
 	sei();
 	
-	while(1)
+#ifdef SD_RECORD
+	/* The card needs the clock running. Pictures stored before this
+	 * boot aren't sent again as new, the log is followed from its last
+	 * record and IDs carry on from there */
+	if(sdlog_init() == 0)
 	{
-		if(tx_image() == -1)
+		sd_ok = 1;
+		sd_seen = sdlog_count();
+		if(sdlog_last(&sd_cur) == 0)
 		{
-			/* The camera goes to sleep while transmitting telemetry,
-			 * sync'ing here seems to prevent it. */
-			c3_sync();
-			rtx_string_P(PSTR("\n"));
-			r = 1;
+			sd_started = 1;
+			sd_id = sd_cur.id + 1;
 		}
-		else
+		
+		snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":SD card, %lu records\n"), sdlog_count());
+	}
+	else snprintf_P(msg, MSG_SIZE, PSTR(PREFIX CALLSIGN ":No SD card\n"));
+	
+	msg_send();
+#endif
+	
+	while(1)
+	{
+		task_telemetry(&pt_tlm);
+#ifdef SD_RECORD
+		if(sd_ok)
 		{
-			/* Put UBLOX5 GPS in proper nav mode */
-			if(gps_ubx_init() != 0)
-				rtx_string_P(PSTR(PREFIX CALLSIGN ":GPS mode set failed\n"));
-			
-			r = 10;
+			task_capture(&pt_cap);
+			task_image_sd(&pt_img);
 		}
+		else
+#endif
+		task_image(&pt_img);
 		
-		for(; r > 0; r--) tx_telemetry();
+		/* Every task is waiting on an interrupt or the clock */
+		clock_idle();
 	}
 	
 	return(0);
@@ -0,0 +1,55 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* MFSK symbol mapping and interleaving. This has no hardware
+ * dependencies so the same code is used by the host modem model */
+
+#include <stdint.h>
+#include "mfsk.h"
+
+/* Position in the block of bit 'p' of the interleaved stream */
+static uint16_t mfsk_bitpos(uint16_t p, uint8_t bits, uint8_t depth)
+{
+	/* Read by column from 'depth' rows of 8 x 'bits' bits */
+	return((p % depth) * (8 * bits) + p / depth);
+}
+
+uint8_t mfsk_symbol(uint8_t *block, uint16_t n, uint8_t bits, uint8_t depth)
+{
+	uint8_t i, s = 0;
+	uint16_t p;
+	
+	for(i = 0; i < bits; i++)
+	{
+		p = mfsk_bitpos(n * bits + i, bits, depth);
+		s = (s << 1) | ((block[p >> 3] >> (7 - (p & 7))) & 1);
+	}
+	
+	/* Gray code */
+	return(s ^ (s >> 1));
+}
+
+void mfsk_unsymbol(uint8_t *block, uint16_t n, uint8_t s, uint8_t bits, uint8_t depth)
+{
+	uint8_t i;
+	uint16_t p;
+	
+	/* Undo the Gray code */
+	s ^= s >> 1;
+	s ^= s >> 2;
+	
+	for(i = 0; i < bits; i++)
+	{
+		p = mfsk_bitpos(n * bits + i, bits, depth);
+		
+		if((s >> (bits - 1 - i)) & 1) block[p >> 3] |= 0x80 >> (p & 7);
+		else block[p >> 3] &= ~(0x80 >> (p & 7));
+	}
+}
+
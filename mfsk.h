@@ -0,0 +1,28 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifndef INC_MFSK_H
+#define INC_MFSK_H
+
+#include <stdint.h>
+
+/* Data is sent in blocks of 'bits' x 'depth' bytes, or 8 x 'depth'
+ * symbols of 'bits' bits each (2 for 4 tones, 3 for 8 tones). The bits
+ * of a block are written into 'depth' rows and read out by column, a
+ * depth of 1 sends each byte in turn. Symbols are Gray coded so that
+ * a neighbouring tone gives a single bit error. The depth is 1 to 255,
+ * so a block can have more than 256 symbols */
+#define MFSK_BLOCK_LEN(bits, depth)     ((bits) * (depth))
+#define MFSK_BLOCK_SYMBOLS(bits, depth) (8 * (depth))
+
+extern uint8_t mfsk_symbol(uint8_t *block, uint16_t n, uint8_t bits, uint8_t depth);
+extern void mfsk_unsymbol(uint8_t *block, uint16_t n, uint8_t s, uint8_t bits, uint8_t depth);
+
+#endif
+
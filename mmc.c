@@ -0,0 +1,326 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* MMC / SD card driver, SPI mode */
+
+#include "config.h"
+#include <stdint.h>
+#include <avr/io.h>
+#include "clock.h"
+#include "mmc.h"
+
+#define CS   (1 << 4) /* PB4 */
+#define MOSI (1 << 5) /* PB5 */
+#define MISO (1 << 6) /* PB6 */
+#define SCK  (1 << 7) /* PB7 */
+
+#define CS_LOW()  PORTB &= ~CS
+#define CS_HIGH() PORTB |= CS
+
+/* Commands */
+#define CMD_GO_IDLE_STATE       (0)
+#define CMD_SEND_OP_COND        (1)
+#define CMD_SEND_IF_COND        (8)
+#define CMD_STOP_TRANSMISSION   (12)
+#define CMD_SET_BLOCKLEN        (16)
+#define CMD_READ_SINGLE_BLOCK   (17)
+#define CMD_WRITE_MULTIPLE_BLOCK (25)
+#define CMD_APP_CMD             (55)
+#define CMD_READ_OCR            (58)
+#define ACMD_SD_SEND_OP_COND    (41)
+
+/* Data tokens */
+#define TOKEN_START_BLOCK (0xFE)
+#define TOKEN_START_MULTI (0xFC)
+#define TOKEN_STOP_MULTI  (0xFD)
+
+/* Timeouts in ms. Cards may take up to a second to initialise and
+ * 250ms to write a block */
+#define INIT_TIMEOUT  (1000)
+#define READ_TIMEOUT  (100)
+#define WRITE_TIMEOUT (250)
+
+static uint8_t sdhc = 0;    /* 1 = Block addressed card */
+static uint8_t writing = 0;
+static uint16_t wr_pos;     /* Bytes written to the current block */
+
+static uint8_t spi(uint8_t b)
+{
+	SPDR = b;
+	while(!(SPSR & (1 << SPIF)));
+	return(SPDR);
+}
+
+static char mmc_wait_ready(uint16_t timeout)
+{
+	uint32_t t;
+	
+	/* The card holds MISO low while it is busy */
+	t = timeout_set(timeout);
+	while(spi(0xFF) != 0xFF)
+		if(timeout_expired(t)) return(-1);
+	
+	return(0);
+}
+
+static uint8_t mmc_cmd(uint8_t cmd, uint32_t arg)
+{
+	uint8_t r, i;
+	
+	spi(0xFF);
+	spi(0x40 | cmd);
+	spi(arg >> 24);
+	spi(arg >> 16);
+	spi(arg >> 8);
+	spi(arg);
+	
+	/* The CRC only matters before SPI mode is fully entered */
+	if(cmd == CMD_GO_IDLE_STATE) spi(0x95);
+	else if(cmd == CMD_SEND_IF_COND) spi(0x87);
+	else spi(0x01);
+	
+	/* The response is within 8 bytes */
+	for(i = 0; i < 8; i++)
+		if(!((r = spi(0xFF)) & 0x80)) break;
+	
+	return(r);
+}
+
+static uint8_t mmc_acmd(uint8_t cmd, uint32_t arg)
+{
+	mmc_cmd(CMD_APP_CMD, 0);
+	return(mmc_cmd(cmd, arg));
+}
+
+static uint32_t mmc_addr(uint32_t block)
+{
+	return(sdhc ? block : block << 9);
+}
+
+char mmc_init(void)
+{
+	uint8_t i, r, v2 = 0;
+	uint32_t t;
+	
+	sdhc = 0;
+	writing = 0;
+	
+	/* SPI master at F_CPU / 64 while initialising, under 400kHz */
+	DDRB  |= CS | MOSI | SCK;
+	DDRB  &= ~MISO;
+	CS_HIGH();
+	SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1);
+	SPSR = 0;
+	
+	/* At least 74 clocks with /CS high */
+	for(i = 0; i < 10; i++) spi(0xFF);
+	
+	CS_LOW();
+	
+	if(mmc_cmd(CMD_GO_IDLE_STATE, 0) != 0x01)
+	{
+		CS_HIGH();
+		return(-1);
+	}
+	
+	/* SD v2 cards echo the check pattern */
+	if(mmc_cmd(CMD_SEND_IF_COND, 0x1AA) == 0x01)
+	{
+		for(i = 0; i < 4; i++) r = spi(0xFF);
+		if(r != 0xAA)
+		{
+			CS_HIGH();
+			return(-2);
+		}
+		
+		v2 = 1;
+	}
+	
+	/* Wait for the card to leave the idle state. MMC cards don't
+	 * know ACMD41 and need CMD1 instead */
+	t = timeout_set(INIT_TIMEOUT);
+	while((r = mmc_acmd(ACMD_SD_SEND_OP_COND, v2 ? 1UL << 30 : 0)) != 0)
+	{
+		if(r & 0x04) break; /* Illegal command */
+		if(timeout_expired(t)) break;
+	}
+	
+	while(r != 0)
+	{
+		if(timeout_expired(t))
+		{
+			CS_HIGH();
+			return(-3);
+		}
+		
+		r = mmc_cmd(CMD_SEND_OP_COND, 0);
+	}
+	
+	/* Is it a high capacity card? */
+	if(v2 && mmc_cmd(CMD_READ_OCR, 0) == 0)
+	{
+		r = spi(0xFF);
+		if(r & 0x40) sdhc = 1;
+		for(i = 0; i < 3; i++) spi(0xFF);
+	}
+	
+	if(!sdhc && mmc_cmd(CMD_SET_BLOCKLEN, MMC_BLOCK) != 0)
+	{
+		CS_HIGH();
+		return(-4);
+	}
+	
+	CS_HIGH();
+	spi(0xFF);
+	
+	/* Full speed, F_CPU / 2 */
+	SPCR = (1 << SPE) | (1 << MSTR);
+	SPSR = (1 << SPI2X);
+	
+	return(0);
+}
+
+char mmc_read(uint32_t block, uint16_t offset, uint8_t *dst, uint16_t length)
+{
+	uint32_t t;
+	uint16_t i;
+	uint8_t b;
+	
+	if(writing) return(-1);
+	
+	CS_LOW();
+	
+	if(mmc_cmd(CMD_READ_SINGLE_BLOCK, mmc_addr(block)) != 0)
+	{
+		CS_HIGH();
+		return(-2);
+	}
+	
+	/* Wait for the data */
+	t = timeout_set(READ_TIMEOUT);
+	while((b = spi(0xFF)) == 0xFF)
+	{
+		if(timeout_expired(t))
+		{
+			CS_HIGH();
+			return(-3);
+		}
+	}
+	
+	if(b != TOKEN_START_BLOCK)
+	{
+		CS_HIGH();
+		return(-4);
+	}
+	
+	/* Keep only the part wanted */
+	for(i = 0; i < MMC_BLOCK; i++)
+	{
+		b = spi(0xFF);
+		if(i >= offset && i - offset < length) *(dst++) = b;
+	}
+	
+	/* Skip the CRC */
+	spi(0xFF);
+	spi(0xFF);
+	
+	CS_HIGH();
+	spi(0xFF);
+	
+	return(0);
+}
+
+static char mmc_write_fail(char r)
+{
+	/* Give up on the write, the card is told to stop */
+	CS_LOW();
+	mmc_cmd(CMD_STOP_TRANSMISSION, 0);
+	mmc_wait_ready(WRITE_TIMEOUT);
+	CS_HIGH();
+	
+	writing = 0;
+	return(r);
+}
+
+char mmc_write_start(uint32_t block)
+{
+	if(writing) return(-1);
+	
+	CS_LOW();
+	
+	if(mmc_cmd(CMD_WRITE_MULTIPLE_BLOCK, mmc_addr(block)) != 0)
+	{
+		CS_HIGH();
+		return(-2);
+	}
+	
+	writing = 1;
+	wr_pos = 0;
+	
+	return(0);
+}
+
+static char mmc_write_byte(uint8_t b)
+{
+	/* Each block begins with a token */
+	if(wr_pos == 0) spi(TOKEN_START_MULTI);
+	
+	spi(b);
+	if(++wr_pos < MMC_BLOCK) return(0);
+	
+	/* End of the block, send a dummy CRC and check it was accepted */
+	spi(0xFF);
+	spi(0xFF);
+	wr_pos = 0;
+	
+	if((spi(0xFF) & 0x1F) != 0x05) return(mmc_write_fail(-3));
+	if(mmc_wait_ready(WRITE_TIMEOUT) != 0) return(mmc_write_fail(-4));
+	
+	return(0);
+}
+
+char mmc_write(const uint8_t *src, uint16_t length)
+{
+	char r;
+	
+	if(!writing) return(-1);
+	
+	while(length--)
+		if((r = mmc_write_byte(*(src++))) != 0) return(r);
+	
+	return(0);
+}
+
+char mmc_write_stop(void)
+{
+	char r;
+	
+	if(!writing) return(-1);
+	
+	/* Pad out the last block */
+	while(wr_pos > 0)
+		if((r = mmc_write_byte(0)) != 0) return(r);
+	
+	spi(TOKEN_STOP_MULTI);
+	spi(0xFF);
+	r = mmc_wait_ready(WRITE_TIMEOUT);
+	
+	CS_HIGH();
+	spi(0xFF);
+	
+	writing = 0;
+	
+	return(r);
+}
+
+char mmc_writing(void)
+{
+	return(writing);
+}
+
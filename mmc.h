@@ -0,0 +1,39 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* MMC / SD card on the SPI bus, /CS on PB4. Blocks are always 512
+ * bytes and addressed by number, for both byte and block addressed
+ * (SDHC) cards. Functions return 0 on success or a negative error */
+
+#ifndef INC_MMC_H
+#define INC_MMC_H
+
+#include <stdint.h>
+
+#define MMC_BLOCK (512)
+
+extern char mmc_init(void);
+
+/* Read length bytes from offset in a block, the rest of the block is
+ * clocked out and dropped. Not possible while a write is open */
+extern char mmc_read(uint32_t block, uint16_t offset, uint8_t *dst, uint16_t length);
+
+/* Streaming writes. mmc_write_start() begins a multi-block write at
+ * block, mmc_write() sends any amount of data and each block is
+ * finished as it fills. mmc_write_stop() pads the last block with
+ * zeros and ends the write. After an error the write is ended */
+extern char mmc_write_start(uint32_t block);
+extern char mmc_write(const uint8_t *src, uint16_t length);
+extern char mmc_write_stop(void);
+
+/* 1 while a write is open */
+extern char mmc_writing(void);
+
+#endif
+
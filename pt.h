@@ -0,0 +1,39 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Cooperative tasks, after Adam Dunkels' protothreads. A task is a
+ * function that returns PT_WAITING whenever it has to wait, and is
+ * called again from the main loop to carry on from the same line.
+ * Local variables are lost across a wait so tasks use statics, and a
+ * task can't use switch() itself. */
+
+#ifndef INC_PT_H
+#define INC_PT_H
+
+#include <stdint.h>
+
+typedef uint16_t pt_t;
+
+#define PT_WAITING (0)
+#define PT_ENDED   (1)
+
+#define PT_INIT(pt)  *(pt) = 0
+#define PT_BEGIN(pt) switch(*(pt)) { case 0:
+#define PT_END(pt)   } *(pt) = 0; return(PT_ENDED)
+
+/* Return to the main loop until the condition is true */
+#define PT_WAIT_UNTIL(pt, c) \
+	do { *(pt) = __LINE__; case __LINE__: if(!(c)) return(PT_WAITING); } while(0)
+
+/* Run a child task to the end, waiting with it */
+#define PT_SPAWN(pt, child, task) \
+	do { PT_INIT(child); PT_WAIT_UNTIL(pt, (task) != PT_WAITING); } while(0)
+
+#endif
+
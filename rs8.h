@@ -7,6 +7,10 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
-extern void encode_rs_8(uint8_t *data, uint8_t *parity, int pad);
+/* nroots may be 32, 16 or 8 */
+extern char encode_rs_8(uint8_t *data, uint8_t *parity, int pad, uint8_t nroots);
+extern void rs8_mac(uint8_t *dst, uint8_t *src, size_t length, uint8_t c);
+extern uint8_t rs8_inv(uint8_t a);
 
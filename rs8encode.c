@@ -10,7 +10,6 @@
 
 #define MM     (8)
 #define NN     (255)
-#define NROOTS (32)
 #define FCR    (112)
 #define PRIM   (11)
 #define IPRIM  (116)
@@ -66,35 +65,77 @@ PROGMEM const uint8_t index_of[] = {
 0x2E,0x4B,0xB9,0x60,0x0F,0xED,0x3E,0xE5,0xF6,0x87,0xA5,0x17,0x3A,0xA3,0x3C,0xB7,
 };
 
+/* Generator polynomials for 32, 16 and 8 roots */
 PROGMEM const uint8_t poly[] = {
 0x00,0xF9,0x3B,0x42,0x04,0x2B,0x7E,0xFB,0x61,0x1E,0x03,0xD5,0x32,0x42,0xAA,0x05,
 0x18,0x05,0xAA,0x42,0x32,0xD5,0x03,0x1E,0x61,0xFB,0x7E,0x2B,0x04,0x42,0x3B,0xF9,
 0x00,
 };
 
+PROGMEM const uint8_t poly16[] = {
+0x7A,0xF0,0x12,0xB4,0xC7,0xB5,0xDD,0x31,0xEA,0xE1,0x3F,0xC7,0x8A,0x28,0x36,0xC5,
+0x00,
+};
+
+PROGMEM const uint8_t poly8[] = {
+0xDB,0x90,0x7F,0x85,0x83,0x8E,0x91,0xAB,0x00,
+};
+
+/* Multiply-accumulate over GF(2^8): dst[i] ^= c * src[i] */
+void rs8_mac(uint8_t *dst, uint8_t *src, size_t length, uint8_t c)
+{
+	uint8_t lc;
+	
+	if(c == 0) return;
+	lc = pgm_read_byte(&index_of[c]);
+	
+	for(; length > 0; length--, dst++, src++)
+	{
+		if(*src == 0) continue;
+		*dst ^= pgm_read_byte(&alpha_to[mod255(pgm_read_byte(&index_of[*src]) + lc)]);
+	}
+}
+
+/* Multiplicative inverse over GF(2^8), a must be non-zero */
+uint8_t rs8_inv(uint8_t a)
+{
+	return(pgm_read_byte(&alpha_to[mod255(NN - pgm_read_byte(&index_of[a]))]));
+}
+
 /* Portable C version */
-void encode_rs_8(uint8_t *data, uint8_t *parity, int pad)
+char encode_rs_8(uint8_t *data, uint8_t *parity, int pad, uint8_t nroots)
 {
 	int i, j;
 	uint8_t feedback;
+	const uint8_t *genpoly;
 	
-	memset(parity, 0, NROOTS * sizeof(uint8_t));
+	switch(nroots)
+	{
+	case 32: genpoly = poly; break;
+	case 16: genpoly = poly16; break;
+	case 8:  genpoly = poly8; break;
+	default: return(-1);
+	}
 	
-	for(i = 0; i < NN - NROOTS - pad; i++)
+	memset(parity, 0, nroots * sizeof(uint8_t));
+	
+	for(i = 0; i < NN - nroots - pad; i++)
 	{
 		feedback = pgm_read_byte(&index_of[data[i] ^ parity[0]]);
 		if(feedback != A0) /* feedback term is non-zero */
 		{
-			for(j = 1; j < NROOTS; j++)
-				parity[j] ^= pgm_read_byte(&alpha_to[mod255(feedback + pgm_read_byte(&poly[NROOTS - j]))]);
+			for(j = 1; j < nroots; j++)
+				parity[j] ^= pgm_read_byte(&alpha_to[mod255(feedback + pgm_read_byte(&genpoly[nroots - j]))]);
 		}
 		
 		/* Shift */
-		memmove(&parity[0], &parity[1], sizeof(uint8_t) * (NROOTS - 1));
+		memmove(&parity[0], &parity[1], sizeof(uint8_t) * (nroots - 1));
 		if(feedback != A0)
-			parity[NROOTS - 1] = pgm_read_byte(&alpha_to[mod255(feedback + pgm_read_byte(&poly[0]))]);
+			parity[nroots - 1] = pgm_read_byte(&alpha_to[mod255(feedback + pgm_read_byte(&genpoly[0]))]);
 		else
-			parity[NROOTS - 1] = 0;
+			parity[nroots - 1] = 0;
 	}
+	
+	return(0);
 }
 
@@ -12,12 +12,13 @@
 #include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <string.h>
+#include "clock.h"
 #include "rtty.h"
-
-/* For camera and GPS timeout */
-extern inline void c3_tick(void);
-extern inline void gps_tick(void);
+#ifdef MFSK
+#include "mfsk.h"
+#endif
 
 /* MARK = Upper tone, Idle, bit  */
 #define TXPIN    (1 << 0) /* PB0 */
@@ -25,38 +26,108 @@ extern inline void gps_tick(void);
 
 #define TXBIT(b) PORTB = (PORTB & ~TXPIN) | ((b) ? TXPIN : 0)
 
-volatile static uint8_t  txpgm = 0;
-volatile static uint8_t *txbuf = 0;
-volatile static uint16_t txlen = 0;
+#ifdef MFSK
+/* MFSK tones are set by the PWM level on OC2A, filtered by an RC
+ * network to give a voltage to the radio */
+#define TXTONEPIN (1 << 7) /* PD7 */
+
+#define TXTONE(s) OCR2A = MFSK_LEVEL + (s) * MFSK_STEP
+
+#if MFSK == 8
+#define MFSK_BITS (3)
+#else
+#define MFSK_BITS (2)
+#endif
+#endif
+
+/* RTTY is driven by the 16-bit TIMER1. The period of up to 2 stop
+ * bits must fit too, so the prescaler is needed below about 225 baud.
+ * RTTY_STOPBITS may be 1.5 and can't be tested here */
+#if F_CPU / RTTY_BAUD > 0xFFFF / 2
+#define RTTY_CS   (_BV(CS11)) /* prescaler 8 */
+#define RTTY_DIV  (8)
+#if F_CPU / 8 / RTTY_BAUD > 0xFFFF / 2
+#error "RTTY_BAUD is too low for TIMER1"
+#endif
+#else
+#define RTTY_CS   (_BV(CS10)) /* prescaler 1 */
+#define RTTY_DIV  (1)
+#endif
+
+/* Timer periods for a data bit and for the stop bits */
+#define RTTY_BIT  ((uint16_t) (F_CPU / RTTY_DIV / RTTY_BAUD))
+#define RTTY_STOP ((uint16_t) (F_CPU / RTTY_DIV / RTTY_BAUD * RTTY_STOPBITS))
+
+/* The transmit queue. Each descriptor points to a block of data in
+ * RAM or program memory, the data must remain valid until it is sent */
+#define RTX_QUEUE (8) /* Must be a power of 2 */
+
+typedef struct {
+	uint8_t *data;
+	uint16_t length;
+	uint8_t pgm;
+} rtx_desc_t;
 
-ISR(TIMER0_COMPA_vect)
+volatile static rtx_desc_t queue[RTX_QUEUE];
+volatile static uint16_t q_head = 0; /* ID of the descriptor being sent */
+volatile static uint16_t q_tail = 0; /* ID of the next free descriptor  */
+
+static inline uint8_t rtx_next_byte(void)
 {
+	volatile rtx_desc_t *d;
+	uint8_t b;
+	
+	/* Skip over any empty descriptors */
+	while(q_head != q_tail && queue[q_head & (RTX_QUEUE - 1)].length == 0)
+		q_head++;
+	
+	/* Send NUL when idle */
+	if(q_head == q_tail) return(0x00);
+	
+	d = &queue[q_head & (RTX_QUEUE - 1)];
+	
+	if(d->pgm == 0) b = *(d->data++);
+	else b = pgm_read_byte(d->data++);
+	
+	if(--d->length == 0) q_head++;
+	
+	return(b);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+#ifdef MFSK
+	/* The current interleaver block */
+	static uint8_t block[MFSK_BLOCK_LEN(MFSK_BITS, MFSK_DEPTH)];
+	static uint16_t sym = 0;
+	uint8_t i;
+	
+	/* Load the next block once the last one is sent */
+	if(sym == 0)
+		for(i = 0; i < MFSK_BLOCK_LEN(MFSK_BITS, MFSK_DEPTH); i++)
+			block[i] = rtx_next_byte();
+	
+	TXTONE(mfsk_symbol(block, sym, MFSK_BITS, MFSK_DEPTH));
+	
+	if(++sym == MFSK_BLOCK_SYMBOLS(MFSK_BITS, MFSK_DEPTH)) sym = 0;
+#else
 	/* The currently transmitting byte, including framing */
 	static uint8_t byte = 0x00;
 	static uint8_t bit  = 0x00;
 	
+	/* The new OCR1A value applies to the bit being started here */
 	uint8_t b = 0;
 	switch(bit++)
 	{
-	case 0: b = 0; break; /* Start bit */
-	case 9: b = 1; break; /* Stop bit */
-	//case 10: b = 1; TCNT0 += OCR0A >> 1; bit = 0; break; /* Stop bit 0.5 */
-	case 10: b = 1; bit = 0; break; /* Stop bit part 2 */
+	case 0: b = 0; OCR1A = RTTY_BIT - 1; break; /* Start bit */
+	case 9: b = 1; OCR1A = RTTY_STOP - 1; bit = 0; break; /* Stop bit(s) */
 	default: b = byte & 1; byte >>= 1; break;
 	}
 	
 	TXBIT(b);
 	
-	if(bit == 0 && txlen > 0)
-	{
-		if(txpgm == 0) byte = *(txbuf++);
-		else byte = pgm_read_byte(txbuf++);
-		txlen--;
-	}
-	
-	/* Camera and GPS timeout tick */
-	c3_tick();
-	gps_tick();
+	if(bit == 0) byte = rtx_next_byte();
+#endif
 }
 
 void rtx_enable(char en)
@@ -67,49 +138,104 @@ void rtx_enable(char en)
 
 void rtx_init(void)
 {
-	/* RTTY is driven by TIMER0 in CTC mode */
-	TCCR0A = _BV(WGM01); /* Mode 2, CTC */
-	TCCR0B = _BV(CS02) | _BV(CS00); /* prescaler 1024 */
-	OCR0A = F_CPU / 1024 / RTTY_BAUD - 1;
-	TIMSK0 = _BV(OCIE0A); /* Enable interrupt */
+	/* RTTY is driven by TIMER1 in CTC mode */
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | RTTY_CS; /* Mode 4, CTC */
+	OCR1A = RTTY_BIT - 1;
+	TIMSK1 = _BV(OCIE1A); /* Enable interrupt */
 	
-	/* We use Port B pins 1 and 2 */
+#ifdef MFSK
+	/* TIMER2 in fast PWM mode sets the tone on OC2A */
+	TCCR2A = _BV(COM2A1) | _BV(WGM21) | _BV(WGM20); /* Mode 3, fast PWM */
+	TCCR2B = _BV(CS20); /* No prescaler */
+	TXTONE(0);
+	DDRD  |= TXTONEPIN;
+#else
 	TXBIT(1);
+#endif
+	
+	/* We use Port B pins 1 and 2 */
 	rtx_enable(0);
 	DDRB  |= TXPIN | TXENABLE;
 }
 
+/* q_head is moved on by the interrupt, read both bytes together */
+static uint16_t rtx_head(void)
+{
+	uint16_t head;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		head = q_head;
+	}
+	
+	return(head);
+}
+
 void inline rtx_wait(void)
 {
-	/* Wait for interrupt driven TX to finish */
-	while(txlen > 0) while(txlen > 0);
+	/* Wait for the queue to empty */
+	while(rtx_head() != q_tail) clock_idle();
+}
+
+char rtx_done(uint16_t id)
+{
+	uint16_t head = rtx_head();
+	
+	/* Has the descriptor left the queue? */
+	return((uint16_t) (id - head) >= (uint16_t) (q_tail - head));
+}
+
+uint16_t rtx_pending(void)
+{
+	uint16_t n = 0;
+	uint16_t i;
+	
+	/* Bytes still waiting in the queue */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for(i = q_head; i != q_tail; i++)
+			n += queue[i & (RTX_QUEUE - 1)].length;
+	}
+	
+	return(n);
+}
+
+static uint16_t rtx_queue(uint8_t *data, size_t length, uint8_t pgm)
+{
+	volatile rtx_desc_t *d;
+	
+	/* Wait for a free descriptor */
+	while((uint16_t) (q_tail - rtx_head()) >= RTX_QUEUE) clock_idle();
+	
+	d = &queue[q_tail & (RTX_QUEUE - 1)];
+	d->data   = data;
+	d->length = length;
+	d->pgm    = pgm;
+	
+	/* Hand it to the interrupt */
+	return(q_tail++);
 }
 
-void rtx_data(uint8_t *data, size_t length)
+uint16_t rtx_data(uint8_t *data, size_t length)
 {
-	rtx_wait();
-	txpgm = 0;
-	txbuf = data;
-	txlen = length;
+	return(rtx_queue(data, length, 0));
 }
 
-void rtx_data_P(PGM_P data, size_t length)
+uint16_t rtx_data_P(PGM_P data, size_t length)
 {
-	rtx_wait();
-	txpgm = 1;
-	txbuf = (uint8_t *) data;
-	txlen = length;
+	return(rtx_queue((uint8_t *) data, length, 1));
 }
 
-void rtx_string(char *s)
+uint16_t rtx_string(char *s)
 {
 	uint16_t length = strlen(s);
-	rtx_data((uint8_t *) s, length);
+	return(rtx_data((uint8_t *) s, length));
 }
 
-void rtx_string_P(PGM_P s)
+uint16_t rtx_string_P(PGM_P s)
 {
 	uint16_t length = strlen_P(s);
-	rtx_data_P(s, length);
+	return(rtx_data_P(s, length));
 }
 
@@ -13,12 +13,24 @@
 #include <stdint.h>
 #include <avr/pgmspace.h>
 
+/* Airtime in milliseconds for n bytes */
+#ifdef MFSK
+#define RTX_MS(n) ((uint32_t) (n) * 8000 / ((uint32_t) RTTY_BAUD * (MFSK == 8 ? 3 : 2)))
+#else
+#define RTX_MS(n) ((uint32_t) (n) * (uint16_t) (18 + RTTY_STOPBITS * 2) * 500 / RTTY_BAUD)
+#endif
+
 extern void rtx_init(void);
 extern void rtx_enable(char en);
 extern void inline rtx_wait(void);
-extern void rtx_data(uint8_t *data, size_t length);
-extern void rtx_data_P(PGM_P data, size_t length);
-extern void rtx_string(char *s);
-extern void rtx_string_P(PGM_P s);
+extern char rtx_done(uint16_t id);
+extern uint16_t rtx_pending(void);
+
+/* These queue the data and return an ID for rtx_done(). IDs wrap after
+ * 65536 entries, an ID held that long may be taken for a newer one */
+extern uint16_t rtx_data(uint8_t *data, size_t length);
+extern uint16_t rtx_data_P(PGM_P data, size_t length);
+extern uint16_t rtx_string(char *s);
+extern uint16_t rtx_string_P(PGM_P s);
 
 #endif
@@ -0,0 +1,333 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Append-only record log, see sdlog.h */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "mmc.h"
+#include "sdlog.h"
+
+/* The log header in block 0: "hadielog" and the log session. The
+ * session changes each format so records of an old log are not
+ * mistaken for new ones */
+PROGMEM static const uint8_t log_magic[8] = { 'h', 'a', 'd', 'i', 'e', 'l', 'o', 'g' };
+
+/* Record header layout, all values little endian
+ *  0: 'H' 'R'
+ *  2: Session (2 bytes)
+ *  4: Record number (4 bytes)
+ *  8: Type
+ *  9: ID (2 bytes)
+ * 11: Length (4 bytes)
+ * 15: Check, the sum of bytes 0 - 14
+ *
+ * The data is followed by a trailer written when the record is ended:
+ *  0: 'E' 'R'
+ *  2: Record number, low byte
+ *  3: The header's check byte
+ * A record without its trailer was cancelled or cut short by a reset,
+ * and is where the log ends */
+#define TRAILER (4)
+
+static uint16_t session;
+static uint32_t next_block;  /* Where the next record begins */
+static uint32_t next_seq;
+static uint32_t rec_left;    /* Bytes still due in the open record */
+static uint32_t rec_length;
+static uint8_t rec_check;    /* Check byte of the open record's header */
+static sdlog_rec_t rec_new;  /* The open record                        */
+static sdlog_rec_t rec_last; /* The last record in the log             */
+static char rec_open = 0;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return(p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+static uint8_t check(const uint8_t *h)
+{
+	uint8_t i, c = 0;
+	for(i = 0; i < SDLOG_HEADER - 1; i++) c += h[i];
+	return(c);
+}
+
+static uint32_t blocks(uint32_t length)
+{
+	return((SDLOG_HEADER + length + TRAILER + MMC_BLOCK - 1) / MMC_BLOCK);
+}
+
+/* Read the header of record seq at block. Returns 1 if it isn't there */
+static char read_header(uint32_t block, uint32_t seq, sdlog_rec_t *r)
+{
+	uint8_t h[SDLOG_HEADER];
+	char i;
+	
+	if((i = mmc_read(block, 0, h, SDLOG_HEADER)) != 0) return(i);
+	
+	if(h[0] != 'H' || h[1] != 'R') return(1);
+	if(h[SDLOG_HEADER - 1] != check(h)) return(1);
+	if(h[2] + (h[3] << 8) != session) return(1);
+	if(get32(&h[4]) != seq) return(1);
+	
+	r->block  = block;
+	r->seq    = seq;
+	r->type   = h[8];
+	r->id     = h[9] + (h[10] << 8);
+	r->length = get32(&h[11]);
+	
+	return(0);
+}
+
+/* Check record r was ended. Returns 1 if not */
+static char read_trailer(const sdlog_rec_t *r)
+{
+	uint8_t h[SDLOG_HEADER], t[TRAILER];
+	uint32_t offset;
+	char i;
+	
+	if((i = mmc_read(r->block, 0, h, SDLOG_HEADER)) != 0) return(i);
+	
+	offset = SDLOG_HEADER + r->length;
+	if((i = mmc_read(r->block + offset / MMC_BLOCK, offset % MMC_BLOCK, t, TRAILER)) != 0) return(i);
+	
+	if(t[0] != 'E' || t[1] != 'R') return(1);
+	if(t[2] != (uint8_t) r->seq || t[3] != h[SDLOG_HEADER - 1]) return(1);
+	
+	return(0);
+}
+
+char sdlog_format(void)
+{
+	uint8_t h[sizeof(log_magic) + 2];
+	char r;
+	
+	if(rec_open) return(-1);
+	
+	session++;
+	memcpy_P(h, log_magic, sizeof(log_magic));
+	h[sizeof(log_magic)] = session;
+	h[sizeof(log_magic) + 1] = session >> 8;
+	
+	if((r = mmc_write_start(0)) != 0) return(r);
+	if((r = mmc_write(h, sizeof(h))) != 0) return(r);
+	if((r = mmc_write_stop()) != 0) return(r);
+	
+	next_block = 1;
+	next_seq = 0;
+	
+	return(0);
+}
+
+char sdlog_init(void)
+{
+	uint8_t h[sizeof(log_magic) + 2];
+	sdlog_rec_t rec;
+	char r;
+	
+	rec_open = 0;
+	session = 0;
+	
+	if((r = mmc_init()) != 0) return(r);
+	if((r = mmc_read(0, 0, h, sizeof(h))) != 0) return(r);
+	
+	if(memcmp_P(h, log_magic, sizeof(log_magic)) != 0) return(sdlog_format());
+	session = h[sizeof(log_magic)] + (h[sizeof(log_magic) + 1] << 8);
+	
+	/* Follow the records to the end */
+	next_block = 1;
+	next_seq = 0;
+	
+	while((r = read_header(next_block, next_seq, &rec)) == 0 &&
+	      (r = read_trailer(&rec)) == 0)
+	{
+		rec_last = rec;
+		next_block += blocks(rec.length);
+		next_seq++;
+	}
+	
+	return(r < 0 ? r : 0);
+}
+
+char sdlog_first(sdlog_rec_t *r)
+{
+	if(rec_open) return(-1);
+	if(next_seq == 0) return(1);
+	return(read_header(1, 0, r));
+}
+
+char sdlog_last(sdlog_rec_t *r)
+{
+	if(next_seq == 0) return(1);
+	*r = rec_last;
+	return(0);
+}
+
+char sdlog_next(sdlog_rec_t *r)
+{
+	if(rec_open) return(-1);
+	if(r->seq + 1 >= next_seq) return(1);
+	return(read_header(r->block + blocks(r->length), r->seq + 1, r));
+}
+
+char sdlog_find(sdlog_rec_t *r, uint8_t type, uint16_t id)
+{
+	sdlog_rec_t rec;
+	char i, found = 1;
+	
+	for(i = sdlog_first(&rec); i == 0; i = sdlog_next(&rec))
+	{
+		if(rec.type != type || rec.id != id) continue;
+		
+		*r = rec;
+		found = 0;
+	}
+	
+	return(i < 0 ? i : found);
+}
+
+char sdlog_read(const sdlog_rec_t *r, uint32_t offset, uint8_t *dst, uint16_t length)
+{
+	uint32_t block;
+	uint16_t o, n;
+	char i;
+	
+	if(rec_open) return(-1);
+	if(offset > r->length || length > r->length - offset) return(-2);
+	
+	offset += SDLOG_HEADER;
+	
+	while(length > 0)
+	{
+		/* Read up to the end of this block */
+		block = r->block + offset / MMC_BLOCK;
+		o = offset % MMC_BLOCK;
+		n = MMC_BLOCK - o;
+		if(n > length) n = length;
+		
+		if((i = mmc_read(block, o, dst, n)) != 0) return(i);
+		
+		dst += n;
+		offset += n;
+		length -= n;
+	}
+	
+	return(0);
+}
+
+char sdlog_begin(uint8_t type, uint16_t id, uint32_t length)
+{
+	uint8_t h[SDLOG_HEADER];
+	char r;
+	
+	if(rec_open) return(-1);
+	
+	h[0] = 'H';
+	h[1] = 'R';
+	h[2] = session;
+	h[3] = session >> 8;
+	put32(&h[4], next_seq);
+	h[8] = type;
+	h[9] = id;
+	h[10] = id >> 8;
+	put32(&h[11], length);
+	h[15] = rec_check = check(h);
+	
+	if((r = mmc_write_start(next_block)) != 0) return(r);
+	if((r = mmc_write(h, SDLOG_HEADER)) != 0) return(r);
+	
+	rec_open = 1;
+	rec_left = rec_length = length;
+	
+	rec_new.block  = next_block;
+	rec_new.seq    = next_seq;
+	rec_new.type   = type;
+	rec_new.id     = id;
+	rec_new.length = length;
+	
+	return(0);
+}
+
+char sdlog_write(const uint8_t *data, uint16_t length)
+{
+	char r;
+	
+	if(!rec_open) return(-1);
+	if(length > rec_left) length = rec_left;
+	
+	if((r = mmc_write(data, length)) != 0)
+	{
+		/* The next record goes in the same place */
+		rec_open = 0;
+		return(r);
+	}
+	
+	rec_left -= length;
+	
+	return(0);
+}
+
+char sdlog_end(void)
+{
+	uint8_t t[TRAILER] = { 0 };
+	char r;
+	
+	if(!rec_open) return(-1);
+	
+	/* Fill in anything not written */
+	while(rec_left > 0)
+		if((r = sdlog_write(t, rec_left < TRAILER ? rec_left : TRAILER)) != 0) return(r);
+	
+	/* The record is only followed once this is on the card */
+	t[0] = 'E';
+	t[1] = 'R';
+	t[2] = next_seq;
+	t[3] = rec_check;
+	
+	rec_open = 0;
+	if((r = mmc_write(t, TRAILER)) != 0) return(r);
+	if((r = mmc_write_stop()) != 0) return(r);
+	
+	rec_last = rec_new;
+	next_block += blocks(rec_length);
+	next_seq++;
+	
+	return(0);
+}
+
+char sdlog_cancel(void)
+{
+	if(!rec_open) return(-1);
+	
+	/* The trailer is never written, so the record isn't followed even
+	 * after a reset. next_block is unchanged and the next is written
+	 * over it */
+	rec_open = 0;
+	return(mmc_write_stop());
+}
+
+char sdlog_busy(void)
+{
+	return(rec_open);
+}
+
+uint32_t sdlog_count(void)
+{
+	return(next_seq);
+}
+
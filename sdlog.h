@@ -0,0 +1,81 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Append-only record log on the MMC / SD card. Block 0 holds the log
+ * header, records follow from block 1. Each record begins on a block
+ * with a 16 byte header, then its data and a 4 byte trailer, padded to
+ * the end of the last block. Records are numbered in order, so the end of the log is the
+ * first block without the next record's header. There's no FAT, the
+ * card is read with tools/sdcat or a raw copy of the card.
+ *
+ * Functions return 0 on success or a negative error. */
+
+#ifndef INC_SDLOG_H
+#define INC_SDLOG_H
+
+#include <stdint.h>
+
+#define SDLOG_HEADER (16)
+
+/* Record types. The pictures of one capture share an id */
+#define SDLOG_IMAGE     (1) /* A full size JPEG from the camera */
+#define SDLOG_TELEMETRY (2) /* Telemetry lines                  */
+#define SDLOG_DOWNLINK  (3) /* A smaller JPEG for the radio     */
+#define SDLOG_THUMB     (4) /* A thumbnail JPEG                 */
+
+typedef struct
+{
+	uint32_t block;   /* The first block of the record */
+	uint32_t seq;     /* Record number, from 0         */
+	uint8_t type;
+	uint16_t id;
+	uint32_t length;  /* Bytes of data                 */
+} sdlog_rec_t;
+
+/* Start the card and find the end of the log. A card without a log
+ * header gets a new empty log */
+extern char sdlog_init(void);
+
+/* Begin a new, empty log. The records of the old one are ignored */
+extern char sdlog_format(void);
+
+/* Write a record. The length must be known at the start, if less is
+ * written before sdlog_end() the rest is filled with zeros. A record
+ * that fails, is cancelled or is cut short by a reset has no trailer,
+ * and is overwritten by the next */
+extern char sdlog_begin(uint8_t type, uint16_t id, uint32_t length);
+extern char sdlog_write(const uint8_t *data, uint16_t length);
+extern char sdlog_end(void);
+
+/* Give up on the record being written, the next is written over it */
+extern char sdlog_cancel(void);
+
+/* 1 while a record is being written, the log can't be read until
+ * it is ended */
+extern char sdlog_busy(void);
+
+/* Records written since the log was formatted */
+extern uint32_t sdlog_count(void);
+
+/* Step through the records. Return 0 with the record, 1 at the end of
+ * the log or a negative error */
+extern char sdlog_first(sdlog_rec_t *r);
+extern char sdlog_next(sdlog_rec_t *r);
+
+/* The last record in the log, returns 1 if it's empty */
+extern char sdlog_last(sdlog_rec_t *r);
+
+/* The most recent record of type with id, returns 1 if there is none */
+extern char sdlog_find(sdlog_rec_t *r, uint8_t type, uint16_t id);
+
+/* Read part of a record's data */
+extern char sdlog_read(const sdlog_rec_t *r, uint32_t offset, uint8_t *dst, uint16_t length);
+
+#endif
+
@@ -93,6 +93,26 @@ PROGMEM static const uint8_t const std_dht11[179] = {
 0xF8,0xF9,0xFA,
 };
 
+/* The order of the coefficients in the JPEG data */
+PROGMEM static const uint8_t zigzag[64] = {
+ 0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,
+12,19,26,33,40,48,41,34,27,20,13, 6, 7,14,21,28,
+35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,
+58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63,
+};
+
+/* Output scale of each coefficient of the AAN DCT, 1.0 = 16384 */
+PROGMEM static const uint16_t aan_scale[64] = {
+16384,22725,21407,19266,16384,12873, 8867, 4520,
+22725,31521,29692,26722,22725,17855,12299, 6270,
+21407,29692,27969,25172,21407,16819,11585, 5906,
+19266,26722,25172,22654,19266,15137,10426, 5315,
+16384,22725,21407,19266,16384,12873, 8867, 4520,
+12873,17855,16819,15137,12873,10114, 6967, 3552,
+ 8867,12299,11585,10426, 8867, 6967, 4799, 2446,
+ 4520, 6270, 5906, 5315, 4520, 3552, 2446, 1247,
+};
+
 /* Helper for returning the current DHT table */
 #define SDHT (s->sdht[s->acpart ? 1 : 0][s->component ? 1 : 0])
 #define DDHT (s->ddht[s->acpart ? 1 : 0][s->component ? 1 : 0])
@@ -106,6 +126,13 @@ PROGMEM static const uint8_t const std_dht11[179] = {
 #define UADJ(i) (SDQT == DDQT ? (i) : (i * SDQT))
 #define BADJ(i) (SDQT == DDQT ? (i) : irdiv(i * SDQT, DDQT))
 
+/* Statistics counters, if enabled */
+#ifdef SSDV_STATS
+#define STAT_ADD(f, n) (s->stats.f += (n))
+#else
+#define STAT_ADD(f, n)
+#endif
+
 /* Integer-only division with rounding */
 static int irdiv(int i, int div)
 {
@@ -276,6 +303,7 @@ static char ssdv_outbits(ssdv_t *s, uint16_t bits, uint8_t length)
 static char ssdv_outbits_sync(ssdv_t *s)
 {
 	uint8_t b = s->outlen % 8;
+	STAT_ADD(pad_bits, b ? 8 - b : 0);
 	if(b) return(ssdv_outbits(s, 0xFF, 8 - b));
 	return(SSDV_OK);
 }
@@ -286,21 +314,120 @@ static char ssdv_out_jpeg_int(ssdv_t *s, uint8_t rle, int value)
 	int intbits;
 	uint8_t hufflen = 0, intlen;
 	
+	/* Nothing is output while scanning */
+	if(s->scanning) return(SSDV_OK);
+	
 	jpeg_encode_int(value, &intbits, &intlen);
 	jpeg_dht_lookup_symbol(s, (rle << 4) | (intlen & 0x0F), &huffbits, &hufflen);
 	
 	ssdv_outbits(s, huffbits, hufflen);
 	if(intlen) ssdv_outbits(s, intbits, intlen);
 	
+	STAT_ADD(bits[s->component], hufflen + intlen);
+	
+	return(SSDV_OK);
+}
+
+static void ssdv_scan_sig(ssdv_t *s, int32_t l)
+{
+	uint16_t mw, mh, mx, my;
+	uint8_t gx, gy;
+	
+	/* Image size in MCU blocks */
+	mw = s->width  >> (s->mcu_mode < 2 ? 4 : 3);
+	mh = s->height >> (s->mcu_mode == 0 || s->mcu_mode == 2 ? 4 : 3);
+	
+	/* Position of this MCU and the cell it falls in */
+	mx = s->mcu_id % mw;
+	my = s->mcu_id / mw;
+	gx = (uint32_t) mx * SSDV_SIG_W / mw;
+	gy = (uint32_t) my * SSDV_SIG_H / mh;
+	
+	/* Only the MCU at the centre of each cell is used */
+	if(mx != (uint32_t) (gx * 2 + 1) * mw / (SSDV_SIG_W * 2)) return;
+	if(my != (uint32_t) (gy * 2 + 1) * mh / (SSDV_SIG_H * 2)) return;
+	
+	if(l < -128) l = -128;
+	else if(l > 127) l = 127;
+	
+	s->scan.sig[gy * SSDV_SIG_W + gx] = l + 128;
+}
+
+static void ssdv_scan_int(ssdv_t *s, int i)
+{
+	/* Dequantise the value */
+	i *= SDQT;
+	
+	if(s->acpart == 0) /* DC */
+	{
+		s->dc[s->component] += i;
+		
+		/* Record the level of each Y block */
+		if(s->component == 0)
+		{
+			int32_t l = s->dc[0] >> 3;
+			s->scan.dc_sum += l;
+			s->scan.dc_sq  += l * l;
+			s->scan.dc_n++;
+			
+			/* The first Y block of the MCU feeds the signature */
+			if(s->mcupart == 0) ssdv_scan_sig(s, l);
+		}
+	}
+	else s->scan.ac_energy += (i < 0 ? -i : i);
+}
+
+static char ssdv_next_part(ssdv_t *s)
+{
+	/* Reached the end of this MCU part */
+	if(++s->mcupart == s->ycparts + 2)
+	{
+		s->mcupart = 0;
+		s->mcu_id++;
+		
+		/* Test for the end of image */
+		if(s->mcu_id >= s->mcu_count)
+		{
+			/* Flush any remaining bits */
+			ssdv_outbits_sync(s);
+			return(SSDV_EOI);
+		}
+		
+		/* Set the packet MCU marker - encoder only */
+		if(s->packet_mcu_id == 0xFFFF)
+		{
+			/* The first MCU of each packet should be byte aligned */
+			ssdv_outbits_sync(s);
+			
+			s->reset_mcu = s->mcu_id;
+			s->packet_mcu_id = s->mcu_id;
+			s->packet_mcu_offset = s->pkt_size_payload - s->out_len;
+		}
+		
+		/* Test for a reset marker */
+		if(s->dri > 0 && s->mcu_id > 0 && s->mcu_id % s->dri == 0)
+		{
+			s->state = S_MARKER;
+			return(SSDV_FEED_ME);
+		}
+	}
+	
+	if(s->mcupart < s->ycparts) s->component = 0;
+	else s->component = s->mcupart - s->ycparts + 1;
+	
+	s->acpart = 0;
+	s->accrle = 0;
+	
 	return(SSDV_OK);
 }
 
 static char ssdv_process(ssdv_t *s)
 {
+	int r;
+	
 	if(s->state == S_HUFF)
 	{
 		uint8_t symbol, width;
-		int r;
 		
 		/* Lookup the code, return if error or not enough bits yet */
 		if((r = jpeg_dht_lookup(s, &symbol, &width)) != SSDV_OK)
@@ -311,7 +438,8 @@ static char ssdv_process(ssdv_t *s)
 			if(symbol == 0x00)
 			{
 				/* No change in DC from last block */
-				if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
+				if(s->scanning) ssdv_scan_int(s, 0);
+				else if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
 				{
 					ssdv_out_jpeg_int(s, 0, s->adc[s->component]);
 				}
@@ -365,8 +493,10 @@ static char ssdv_process(ssdv_t *s)
 		
 		/* Decode the integer */
 		i = jpeg_int(s->workbits >> (s->worklen - s->needbits), s->needbits);
+		STAT_ADD(coefs[s->component], 1);
 		
-		if(s->acpart == 0) /* DC */
+		if(s->scanning) ssdv_scan_int(s, i);
+		else if(s->acpart == 0) /* DC */
 		{
 			if(s->reset_mcu == s->mcu_id && (s->mcupart == 0 || s->mcupart >= s->ycparts))
 			{
@@ -402,6 +532,7 @@ static char ssdv_process(ssdv_t *s)
 			else
 			{
 				/* AC value got reduced to 0 in the DQT conversion */
+				STAT_ADD(zeroed, 1);
 				if(s->acpart >= 63)
 				{
 					ssdv_out_jpeg_int(s, 0, 0);
@@ -424,44 +555,158 @@ static char ssdv_process(ssdv_t *s)
 	
 	if(s->acpart >= 64)
 	{
-		/* Reached the end of this MCU part */
-		if(++s->mcupart == s->ycparts + 2)
-		{
-			s->mcupart = 0;
-			s->mcu_id++;
-			
-			/* Test for the end of image */
-			if(s->mcu_id >= s->mcu_count)
-			{
-				/* Flush any remaining bits */
-				ssdv_outbits_sync(s);
-				return(SSDV_EOI);
-			}
-			
-			/* Set the packet MCU marker - encoder only */
-			if(s->packet_mcu_id == 0xFFFF)
-			{
-				/* The first MCU of each packet should be byte aligned */
-				ssdv_outbits_sync(s);
-				
-				s->reset_mcu = s->mcu_id;
-				s->packet_mcu_id = s->mcu_id;
-				s->packet_mcu_offset = SSDV_PKT_SIZE_PAYLOAD - s->out_len;
-			}
-			
-			/* Test for a reset marker */
-			if(s->dri > 0 && s->mcu_id > 0 && s->mcu_id % s->dri == 0)
-			{
-				s->state = S_MARKER;
-				return(SSDV_FEED_ME);
-			}
-		}
+		r = ssdv_next_part(s);
+		if(r != SSDV_OK) return(r);
+	}
+	
+	if(!s->scanning && s->out_len == 0) return(SSDV_BUFFER_FULL);
+	
+	return(SSDV_OK);
+}
+
+/*****************************************************************************/
+
+/* Raw pixel input. Each Y block is transformed with the AAN DCT, as in
+ * the IJG's jfdctfst.c, in 16-bit fixed point with 8 fractional bits.
+ * The outputs are 8 * aan_scale[] times the true coefficients, this is
+ * taken out in the quantisation */
+#define FIX_0_382683433 (98)
+#define FIX_0_541196100 (139)
+#define FIX_0_707106781 (181)
+#define FIX_1_306562965 (334)
+#define FMUL(v, c) ((int16_t) (((int32_t) (v) * (c)) >> 8))
+
+static void ssdv_fdct8(int16_t *p, uint8_t st)
+{
+	int16_t t0, t1, t2, t3, t4, t5, t6, t7;
+	int16_t t10, t11, t12, t13;
+	int16_t z1, z2, z3, z4, z5, z11, z13;
+	
+	t0 = p[0 * st] + p[7 * st];
+	t7 = p[0 * st] - p[7 * st];
+	t1 = p[1 * st] + p[6 * st];
+	t6 = p[1 * st] - p[6 * st];
+	t2 = p[2 * st] + p[5 * st];
+	t5 = p[2 * st] - p[5 * st];
+	t3 = p[3 * st] + p[4 * st];
+	t4 = p[3 * st] - p[4 * st];
+	
+	/* Even part */
+	t10 = t0 + t3;
+	t13 = t0 - t3;
+	t11 = t1 + t2;
+	t12 = t1 - t2;
+	
+	p[0 * st] = t10 + t11;
+	p[4 * st] = t10 - t11;
+	
+	z1 = FMUL(t12 + t13, FIX_0_707106781);
+	p[2 * st] = t13 + z1;
+	p[6 * st] = t13 - z1;
+	
+	/* Odd part */
+	t10 = t4 + t5;
+	t11 = t5 + t6;
+	t12 = t6 + t7;
+	
+	z5 = FMUL(t10 - t12, FIX_0_382683433);
+	z2 = FMUL(t10, FIX_0_541196100) + z5;
+	z4 = FMUL(t12, FIX_1_306562965) + z5;
+	z3 = FMUL(t11, FIX_0_707106781);
+	
+	z11 = t7 + z3;
+	z13 = t7 - z3;
+	
+	p[5 * st] = z13 + z2;
+	p[3 * st] = z13 - z2;
+	p[1 * st] = z11 + z4;
+	p[7 * st] = z11 - z4;
+}
+
+static void ssdv_raw_block(ssdv_t *s)
+{
+	int16_t *b = s->blk;
+	uint8_t *p = s->inp;
+	int16_t d;
+	uint8_t x, y, i;
+	
+	/* Read the block, level shifted */
+	for(y = 0; y < 8; y++, p += s->raw_stride)
+		for(x = 0; x < 8; x++)
+			*(b++) = p[x] - 128;
+	
+	s->inp += 8;
+	s->in_len--;
+	
+	/* Rows, then columns */
+	for(i = 0; i < 64; i += 8) ssdv_fdct8(&s->blk[i], 1);
+	for(i = 0; i < 8; i++) ssdv_fdct8(&s->blk[i], 8);
+	
+	/* Quantise with the output tables, rounding to the nearest */
+	for(i = 0; i < 64; i++)
+	{
+		b = &s->blk[pgm_read_byte(&zigzag[i])];
+		d = ((uint32_t) s->ddqt[0][1 + i] * pgm_read_word(&aan_scale[b - s->blk]) + 1024) >> 11;
+		
+		if(*b < 0) *b = -((d / 2 - *b) / d);
+		else *b = (*b + d / 2) / d;
+	}
+}
+
+static char ssdv_raw_process(ssdv_t *s)
+{
+	int16_t i;
+	uint8_t n;
+	char r;
+	
+	if(s->mcupart > 0)
+	{
+		/* Cb and Cr are blank, a zero DC and an EOB */
+		ssdv_out_jpeg_int(s, 0, 0);
+		s->acpart = (s->acpart == 0 ? 1 : 64);
+	}
+	else if(s->acpart == 0)
+	{
+		/* The next Y block, and its DC value */
+		if(s->in_len == 0) return(SSDV_FEED_ME);
+		ssdv_raw_block(s);
+		
+		i = s->blk[0];
+		if(s->reset_mcu == s->mcu_id) ssdv_out_jpeg_int(s, 0, i);
+		else ssdv_out_jpeg_int(s, 0, i - s->adc[0]);
+		s->adc[0] = i;
 		
-		if(s->mcupart < s->ycparts) s->component = 0;
-		else s->component = s->mcupart - s->ycparts + 1;
+		s->acpart = 1;
+	}
+	else
+	{
+		/* Find the next non-zero AC value */
+		for(n = s->acpart; n < 64; n++)
+			if((i = s->blk[pgm_read_byte(&zigzag[n])]) != 0) break;
 		
-		s->acpart = 0;
-		s->accrle = 0;
+		if(n == 64)
+		{
+			/* EOB */
+			ssdv_out_jpeg_int(s, 0, 0);
+			s->acpart = 64;
+		}
+		else if(n - s->acpart >= 16)
+		{
+			/* 16 zeros */
+			ssdv_out_jpeg_int(s, 15, 0);
+			s->acpart += 16;
+		}
+		else
+		{
+			ssdv_out_jpeg_int(s, n - s->acpart, i);
+			s->acpart = n + 1;
+		}
+	}
+	
+	if(s->acpart >= 64)
+	{
+		r = ssdv_next_part(s);
+		if(r != SSDV_OK) return(r);
 	}
 	
 	if(s->out_len == 0) return(SSDV_BUFFER_FULL);
@@ -471,6 +716,83 @@ static char ssdv_process(ssdv_t *s)
 
 /*****************************************************************************/
 
+/* Number of bytes of each packet covered by the repair packets */
+#define RPLEN (SSDV_PKT_SIZE_HEADER + s->pkt_size_payload - SSDV_PKT_OFFSET_REPAIR)
+
+static uint8_t ssdv_enc_type(ssdv_t *s, uint8_t type)
+{
+	/* Signal the number of RS codes in the packet type */
+	if(s->pkt_rscodes == 16) return(type + 2);
+	if(s->pkt_rscodes == 8) return(type + 4);
+	return(type);
+}
+
+static char ssdv_enc_fec(ssdv_t *s)
+{
+	uint8_t i;
+	uint32_t x;
+	
+	/* Calculate the CRC codes */
+	i = SSDV_PKT_SIZE_HEADER + s->pkt_size_payload - 1;
+	x = crc32(&s->out[1], i);
+	
+	i++;
+	s->out[i++] = (x >> 24) & 0xFF;
+	s->out[i++] = (x >> 16) & 0xFF;
+	s->out[i++] = (x >> 8) & 0xFF;
+	s->out[i++] = x & 0xFF;
+	
+	/* Generate the RS codes */
+	if(encode_rs_8(&s->out[1], &s->out[i], 0, s->pkt_rscodes) != 0)
+		return(SSDV_ERROR);
+	
+	return(SSDV_OK);
+}
+
+static void ssdv_enc_repair_add(ssdv_t *s)
+{
+	uint8_t j, *p;
+	
+	if(s->rp_n == 0) s->rp_first = s->packet_id;
+	
+	/* Add this packet to the parity of each repair packet */
+	for(p = s->rp, j = 0; j < s->rp_count; j++, p += RPLEN)
+		rs8_mac(p, &s->out[SSDV_PKT_OFFSET_REPAIR], RPLEN,
+		        rs8_inv(s->rp_n ^ (0xFF - j)));
+	
+	s->rp_n++;
+}
+
+static char ssdv_enc_repair_packet(ssdv_t *s)
+{
+	uint8_t j = s->rp_count - s->rp_left--;
+	
+	s->out[0]  = 0x55;                /* Sync */
+	s->out[1]  = ssdv_enc_type(s, SSDV_TYPE_REPAIR); /* Type */
+	s->out[2]  = s->callsign >> 24;
+	s->out[3]  = s->callsign >> 16;
+	s->out[4]  = s->callsign >> 8;
+	s->out[5]  = s->callsign;
+	s->out[6]  = s->image_id;         /* Image ID */
+	s->out[7]  = s->rp_first >> 8;    /* First packet ID MSB */
+	s->out[8]  = s->rp_first & 0xFF;  /* First packet ID LSB */
+	s->out[9]  = s->rp_n;             /* Packets in this group */
+	s->out[10] = j;                   /* Repair index */
+	s->out[11] = s->rp_count;         /* Repair packets per group */
+	
+	memcpy(&s->out[SSDV_PKT_OFFSET_REPAIR], &s->rp[j * RPLEN], RPLEN);
+	STAT_ADD(repair, 1);
+	
+	/* Begin the next group once the last repair packet is sent */
+	if(s->rp_left == 0)
+	{
+		memset(s->rp, 0, s->rp_count * RPLEN);
+		s->rp_n = 0;
+	}
+	
+	return(ssdv_enc_fec(s));
+}
+
 static void ssdv_memset_prng(uint8_t *s, size_t n)
 {
 	/* A very simple PRNG for noise whitening */
@@ -670,6 +992,8 @@ char ssdv_enc_init(ssdv_t *s, char *callsign, uint8_t image_id)
 	memset(s, 0, sizeof(ssdv_t));
 	s->image_id = image_id;
 	s->callsign = encode_callsign(callsign);
+	s->pkt_rscodes = SSDV_PKT_SIZE_RSCODES;
+	s->pkt_size_payload = SSDV_PKT_SIZE_PAYLOAD;
 	
 	/* Prepare the output JPEG tables */
 	s->ddqt[0] = dtblcpy(s, std_dqt0, sizeof(std_dqt0));
@@ -682,11 +1006,24 @@ char ssdv_enc_init(ssdv_t *s, char *callsign, uint8_t image_id)
 	return(SSDV_OK);
 }
 
+char ssdv_enc_set_rscodes(ssdv_t *s, uint8_t rscodes)
+{
+	/* Must be called before ssdv_enc_set_buffer(). The repair packets
+	 * are sized from the payload, so also before ssdv_enc_set_repair() */
+	if(rscodes != 32 && rscodes != 16 && rscodes != 8) return(SSDV_ERROR);
+	if(s->rp_count) return(SSDV_ERROR);
+	
+	s->pkt_rscodes = rscodes;
+	s->pkt_size_payload = SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - rscodes;
+	
+	return(SSDV_OK);
+}
+
 char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer)
 {
 	s->out     = buffer;
 	s->outp    = buffer + SSDV_PKT_SIZE_HEADER;
-	s->out_len = SSDV_PKT_SIZE_PAYLOAD;
+	s->out_len = s->pkt_size_payload;
 	
 	/* Zero the payload memory */
 	memset(s->out, 0, SSDV_PKT_SIZE);
@@ -697,21 +1034,32 @@ char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer)
 	return(SSDV_OK);
 }
 
-char ssdv_enc_get_packet(ssdv_t *s)
+char ssdv_enc_set_repair(ssdv_t *s, uint8_t *buffer, uint8_t group, uint8_t count)
 {
-	int r;
-	uint8_t b;
+	/* Each packet in a group needs a unique coefficient */
+	if(count > 0 && (group == 0 || group > 0xFF - count)) return(SSDV_ERROR);
 	
-	/* Have we reached the end of the image? */
-	if(s->state == S_EOI) return(SSDV_EOI);
+	s->rp       = buffer;
+	s->rp_group = group;
+	s->rp_count = count;
+	s->rp_n     = 0;
+	s->rp_left  = 0;
 	
-	/* If the output buffer is empty, re-initialise */
-	if(s->out_len == 0) ssdv_enc_set_buffer(s, s->out);
+	if(count) memset(s->rp, 0, count * RPLEN);
+	
+	return(SSDV_OK);
+}
+
+static char ssdv_parse(ssdv_t *s)
+{
+	int r;
+	uint8_t b;
 	
 	while(s->in_len)
 	{
 		b = *(s->inp++);
 		s->in_len--;
+		STAT_ADD(in_bytes, 1);
 		
 		/* Skip bytes if necessary */
 		if(s->in_skip) { s->in_skip--; continue; }
@@ -759,9 +1107,15 @@ char ssdv_enc_get_packet(ssdv_t *s)
 		
 		case S_HUFF:
 		case S_INT:
+			s->scan.bytes++;
+			
 			/* Is the next byte a stuffing byte? Skip it */
 			/* TODO: Test the next byte is actually 0x00 */
-			if(b == 0xFF) s->in_skip++;
+			if(b == 0xFF)
+			{
+				s->in_skip++;
+				STAT_ADD(stuffing, 1);
+			}
 			
 			/* Add the new byte to the work area */
 			s->workbits = (s->workbits << 8) | b;
@@ -770,65 +1124,8 @@ char ssdv_enc_get_packet(ssdv_t *s)
 			/* Process the new data until more needed, or an error occurs */
 			while((r = ssdv_process(s)) == SSDV_OK);
 			
-			if(r == SSDV_BUFFER_FULL || r == SSDV_EOI)
-			{
-				uint16_t mcu_id       = s->packet_mcu_id;
-				uint8_t i, mcu_offset = s->packet_mcu_offset;
-				uint32_t x;
-				
-				if(mcu_offset != 0xFF && mcu_offset >= SSDV_PKT_SIZE_PAYLOAD)
-				{
-					/* The first MCU begins in the next packet, not this one */
-					mcu_id = 0xFFFF;
-					mcu_offset = 0xFF;
-					s->packet_mcu_offset -= SSDV_PKT_SIZE_PAYLOAD;
-				}
-				else
-				{
-					/* Clear the MCU data for the next packet */
-					s->packet_mcu_id = 0xFFFF;
-					s->packet_mcu_offset = 0xFF;
-				}
-				
-				/* A packet is ready, create the headers */
-				s->out[0]  = 0x55;                /* Sync */
-				s->out[1]  = 0x66;                /* Type */
-				s->out[2]  = s->callsign >> 24;
-				s->out[3]  = s->callsign >> 16;
-				s->out[4]  = s->callsign >> 8;
-				s->out[5]  = s->callsign;
-				s->out[6]  = s->image_id;         /* Image ID */
-				s->out[7]  = s->packet_id >> 8;   /* Packet ID MSB */
-				s->out[8]  = s->packet_id & 0xFF; /* Packet ID LSB */
-				s->out[9]  = s->width >> 4;       /* Width / 16 */
-				s->out[10] = s->height >> 4;      /* Height / 16 */
-				s->out[11] = s->mcu_mode & 0x03;  /* MCU mode (2 bits) */
-				s->out[12] = mcu_offset;          /* Next MCU offset */
-				s->out[13] = mcu_id >> 8;         /* MCU ID MSB */
-				s->out[14] = mcu_id & 0xFF;       /* MCU ID LSB */
-				
-				/* Fill any remaining bytes with noise */
-				if(s->out_len > 0) ssdv_memset_prng(s->outp, s->out_len);
-				
-				/* Calculate the CRC codes */
-				x = crc32(&s->out[1], SSDV_PKT_SIZE_CRCDATA);
-				
-				i = 1 + SSDV_PKT_SIZE_CRCDATA;
-				s->out[i++] = (x >> 24) & 0xFF;
-				s->out[i++] = (x >> 16) & 0xFF;
-				s->out[i++] = (x >> 8) & 0xFF;
-				s->out[i++] = x & 0xFF;
-				
-				/* Generate the RS codes */
-				encode_rs_8(&s->out[1], &s->out[i], 0);
-				
-				s->packet_id++;
-				
-				/* Have we reached the end of the image data? */
-				if(r == SSDV_EOI) s->state = S_EOI;
-				
-				return(SSDV_OK);
-			}
+			/* Return if a packet is ready or the image is complete */
+			if(r == SSDV_BUFFER_FULL || r == SSDV_EOI) return(r);
 			else if(r != SSDV_FEED_ME) return(SSDV_ERROR);
 			break;
 		
@@ -842,6 +1139,108 @@ char ssdv_enc_get_packet(ssdv_t *s)
 	return(SSDV_FEED_ME);
 }
 
+char ssdv_enc_get_packet(ssdv_t *s)
+{
+	int r;
+	
+	/* Send any repair packets due for the last group */
+	if(s->rp_left) return(ssdv_enc_repair_packet(s));
+	
+	/* Have we reached the end of the image? */
+	if(s->state == S_EOI) return(SSDV_EOI);
+	
+	/* If the output buffer is empty, re-initialise */
+	if(s->out_len == 0) ssdv_enc_set_buffer(s, s->out);
+	
+	if(s->raw) while((r = ssdv_raw_process(s)) == SSDV_OK);
+	else r = ssdv_parse(s);
+	
+	if(r == SSDV_BUFFER_FULL || r == SSDV_EOI)
+	{
+		uint16_t mcu_id    = s->packet_mcu_id;
+		uint8_t mcu_offset = s->packet_mcu_offset;
+		
+		if(mcu_offset != 0xFF && mcu_offset >= s->pkt_size_payload)
+		{
+			/* The first MCU begins in the next packet, not this one */
+			mcu_id = 0xFFFF;
+			mcu_offset = 0xFF;
+			s->packet_mcu_offset -= s->pkt_size_payload;
+		}
+		else
+		{
+			/* Clear the MCU data for the next packet */
+			s->packet_mcu_id = 0xFFFF;
+			s->packet_mcu_offset = 0xFF;
+		}
+		
+		/* A packet is ready, create the headers */
+		s->out[0]  = 0x55;                /* Sync */
+		s->out[1]  = ssdv_enc_type(s, SSDV_TYPE_NORMAL); /* Type */
+		s->out[2]  = s->callsign >> 24;
+		s->out[3]  = s->callsign >> 16;
+		s->out[4]  = s->callsign >> 8;
+		s->out[5]  = s->callsign;
+		s->out[6]  = s->image_id;         /* Image ID */
+		s->out[7]  = s->packet_id >> 8;   /* Packet ID MSB */
+		s->out[8]  = s->packet_id & 0xFF; /* Packet ID LSB */
+		s->out[9]  = s->width >> 4;       /* Width / 16 */
+		s->out[10] = s->height >> 4;      /* Height / 16 */
+		s->out[11] = s->mcu_mode & 0x03;  /* MCU mode (2 bits) */
+		s->out[12] = mcu_offset;          /* Next MCU offset */
+		s->out[13] = mcu_id >> 8;         /* MCU ID MSB */
+		s->out[14] = mcu_id & 0xFF;       /* MCU ID LSB */
+		
+		/* Fill any remaining bytes with noise */
+		if(s->out_len > 0) ssdv_memset_prng(s->outp, s->out_len);
+		STAT_ADD(fill_bytes, s->out_len);
+		STAT_ADD(packets, 1);
+		
+		/* Update the repair packets for this group */
+		if(s->rp_count)
+		{
+			ssdv_enc_repair_add(s);
+			if(s->rp_n == s->rp_group || r == SSDV_EOI)
+				s->rp_left = s->rp_count;
+		}
+		
+		if(ssdv_enc_fec(s) != SSDV_OK) return(SSDV_ERROR);
+		
+		s->packet_id++;
+		
+		/* Have we reached the end of the image data? */
+		if(r == SSDV_EOI) s->state = S_EOI;
+		
+		return(SSDV_OK);
+	}
+	
+	return(r);
+}
+
+char ssdv_enc_set_raw(ssdv_t *s, uint16_t width, uint16_t height)
+{
+	/* The image dimensions must be a multiple of 16 */
+	if((width & 0x0F) || (height & 0x0F)) return(SSDV_ERROR);
+	
+	/* One Y block per MCU */
+	s->raw = 1;
+	s->width = width;
+	s->height = height;
+	s->mcu_mode = 3;
+	s->ycparts = 1;
+	s->mcu_count = (width >> 3) * (height >> 3);
+	
+	return(SSDV_OK);
+}
+
+char ssdv_enc_feed_raw(ssdv_t *s, uint8_t *pixels, uint8_t blocks, uint16_t stride)
+{
+	s->inp = pixels;
+	s->in_len = blocks;
+	s->raw_stride = stride;
+	return(SSDV_OK);
+}
+
 char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length)
 {
 	s->inp    = buffer;
@@ -849,5 +1248,47 @@ char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length)
 	return(SSDV_OK);
 }
 
+char ssdv_scan_init(ssdv_t *s)
+{
+	memset(s, 0, sizeof(ssdv_t));
+	s->scanning = 1;
+	return(SSDV_OK);
+}
+
+char ssdv_scan(ssdv_t *s)
+{
+	int r;
+	
+	if(s->state == S_EOI) return(SSDV_EOI);
+	
+	r = ssdv_parse(s);
+	if(r == SSDV_EOI) s->state = S_EOI;
+	else if(r == SSDV_FEED_ME && s->state == S_EOI) r = SSDV_EOI;
+	
+	return(r);
+}
+
+uint32_t ssdv_scan_dc_variance(ssdv_t *s)
+{
+	int32_t mean;
+	
+	if(s->scan.dc_n == 0) return(0);
+	
+	mean = s->scan.dc_sum / (int32_t) s->scan.dc_n;
+	return(s->scan.dc_sq / s->scan.dc_n - mean * mean);
+}
+
+uint8_t ssdv_sig_diff(uint8_t *a, uint8_t *b)
+{
+	uint16_t d = 0;
+	uint8_t i;
+	
+	/* The mean absolute difference between two signatures */
+	for(i = 0; i < SSDV_SIG_LEN; i++)
+		d += (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]);
+	
+	return(d / SSDV_SIG_LEN);
+}
+
 /*****************************************************************************/
 
@@ -17,6 +17,7 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stdint.h>
+#include "config.h"
 
 #ifndef INC_SSDV_H
 #define INC_SSDV_H
@@ -36,6 +37,56 @@
 #define SSDV_PKT_SIZE_PAYLOAD (SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_SIZE_RSCODES)
 #define SSDV_PKT_SIZE_CRCDATA (SSDV_PKT_SIZE_HEADER + SSDV_PKT_SIZE_PAYLOAD - 1)
 
+/* The number of RS codes can be reduced to 16 or 8 per packet, the
+ * payload grows to fill the space. This is the largest payload */
+#define SSDV_PKT_MIN_RSCODES  (0x08)
+#define SSDV_PKT_MAX_PAYLOAD  (SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - SSDV_PKT_MIN_RSCODES)
+
+/* Packet types. The type is offset by 2 for 16 RS codes and 4 for 8 */
+#define SSDV_TYPE_NORMAL (0x66)
+#define SSDV_TYPE_REPAIR (0x67)
+
+/* Repair packets carry the parity of a group of image packets, covering
+ * the MCU offset, MCU ID and payload of each. The header of a repair
+ * packet replaces the packet ID with the ID of the first packet in the
+ * group, followed by the group size, repair index and repair count.
+ * Repair packet j is the sum over the group of packet i multiplied by
+ * 1 / (i ^ (0xFF - j)) in GF(2^8). Any lost packets can be recovered
+ * from the same number of repair packets. */
+#define SSDV_PKT_OFFSET_REPAIR (12)
+#define SSDV_PKT_SIZE_REPAIR   (SSDV_PKT_SIZE_HEADER + SSDV_PKT_MAX_PAYLOAD - SSDV_PKT_OFFSET_REPAIR)
+
+#ifdef SSDV_STATS
+typedef struct
+{
+	uint32_t in_bytes;   /* JPEG bytes read                              */
+	uint16_t stuffing;   /* Stuffing bytes skipped in the JPEG data      */
+	uint32_t coefs[3];   /* Non-zero coefficients read for Y, Cb and Cr  */
+	uint32_t zeroed;     /* AC coefficients zeroed by the new DQT tables */
+	uint32_t bits[3];    /* Huffman and integer bits output for each     */
+	uint16_t pad_bits;   /* Bits used to byte align MCUs                 */
+	uint16_t fill_bytes; /* Unused payload bytes filled with noise       */
+	uint16_t packets;    /* Image packets produced                       */
+	uint16_t repair;     /* Repair packets produced                      */
+} ssdv_stats_t;
+#endif
+
+/* Size of the image signature, a grid of Y levels */
+#define SSDV_SIG_W   (8)
+#define SSDV_SIG_H   (6)
+#define SSDV_SIG_LEN (SSDV_SIG_W * SSDV_SIG_H)
+
+/* Image metrics gathered while parsing */
+typedef struct
+{
+	uint32_t bytes;      /* Entropy coded bytes                          */
+	uint32_t ac_energy;  /* Sum of the dequantised AC magnitudes         */
+	int32_t  dc_sum;     /* Sum of the Y block levels                    */
+	uint32_t dc_sq;      /* Sum of the squared Y block levels            */
+	uint32_t dc_n;       /* Number of Y blocks                           */
+	uint8_t  sig[SSDV_SIG_LEN]; /* Level of the MCU at the centre of each cell */
+} ssdv_scan_t;
+
 #define TBL_LEN (546) /* Maximum size of the DQT and DHT tables */
 #define HBUFF_LEN (16) /* Extra space for reading marker data */
 //#define COMPONENTS (3)
@@ -53,6 +104,8 @@ typedef struct
 	uint16_t mcu_count;
 	uint16_t packet_mcu_id;
 	uint8_t  packet_mcu_offset;
+	uint8_t  pkt_rscodes;      /* Number of RS codes in each packet      */
+	uint8_t  pkt_size_payload; /* Payload bytes in each packet           */
 	
 	/* Source buffer */
 	uint8_t *inp;      /* Pointer to next input byte                    */
@@ -96,9 +149,17 @@ typedef struct
 	uint16_t dri;       /* Reset interval                               */
 	uint32_t reset_mcu; /* MCU block to do absolute encoding            */
 	char needbits;      /* Number of bits needed to decode integer      */
+	uint8_t raw;        /* 1 = Input is raw pixels, not a JPEG          */
+	uint16_t raw_stride; /* Bytes between lines of raw pixels           */
+	uint8_t scanning;   /* 1 = Only gather the image metrics            */
+	ssdv_scan_t scan;   /* Image metrics                                */
 	
-	/* The input huffman and quantisation tables */
-	uint8_t stbls[TBL_LEN + HBUFF_LEN];
+	/* The input huffman and quantisation tables, or the DCT block
+	 * when encoding raw pixels */
+	union {
+		uint8_t stbls[TBL_LEN + HBUFF_LEN];
+		int16_t blk[64];
+	};
 	uint8_t *sdht[2][2], *sdqt[2];
 	uint16_t stbl_len;
 	
@@ -107,13 +168,45 @@ typedef struct
 	uint8_t *ddht[2][2], *ddqt[2];
 	uint16_t dtbl_len;
 	
+	/* Repair packet state */
+	uint8_t *rp;        /* Parity buffer, rp_count * SSDV_PKT_SIZE_REPAIR  */
+	uint8_t rp_group;   /* Number of image packets in each group        */
+	uint8_t rp_count;   /* Number of repair packets for each group      */
+	uint8_t rp_n;       /* Image packets in the current group so far    */
+	uint8_t rp_left;    /* Repair packets still to be sent              */
+	uint16_t rp_first;  /* Packet ID of the first packet in the group   */
+	
+#ifdef SSDV_STATS
+	ssdv_stats_t stats;
+#endif
+	
 } ssdv_t;
 
 /* Encoding */
 extern char ssdv_enc_init(ssdv_t *s, char *callsign, uint8_t image_id);
-extern char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer);
+
+/* ssdv_enc_set_rscodes() is called before ssdv_enc_set_buffer() and
+ * ssdv_enc_set_repair(), the repair data is sized from the payload.
+ * It fails once repair packets are set */
+extern char ssdv_enc_set_rscodes(ssdv_t *s, uint8_t rscodes);
+extern char ssdv_enc_set_buffer(ssdv_t *s, uint8_t *buffer); /* Can be changed between packets */
+extern char ssdv_enc_set_repair(ssdv_t *s, uint8_t *buffer, uint8_t group, uint8_t count); /* Sized by ssdv_enc_set_rscodes() */
 extern char ssdv_enc_get_packet(ssdv_t *s);
 extern char ssdv_enc_feed(ssdv_t *s, uint8_t *buffer, size_t length);
 
+/* Encoding raw 8-bit grey pixels instead of a JPEG, called after
+ * ssdv_enc_init(). The colour components are left blank. The image is
+ * fed in bands of 8 lines, each one or more 8x8 blocks wide, left to
+ * right and top to bottom. ssdv_enc_get_packet() asks for the next
+ * band with SSDV_FEED_ME */
+extern char ssdv_enc_set_raw(ssdv_t *s, uint16_t width, uint16_t height);
+extern char ssdv_enc_feed_raw(ssdv_t *s, uint8_t *pixels, uint8_t blocks, uint16_t stride);
+
+/* Scanning, input is given with ssdv_enc_feed() */
+extern char ssdv_scan_init(ssdv_t *s);
+extern char ssdv_scan(ssdv_t *s);
+extern uint32_t ssdv_scan_dc_variance(ssdv_t *s);
+extern uint8_t ssdv_sig_diff(uint8_t *a, uint8_t *b);
+
 #endif
 
@@ -0,0 +1,21 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Stand-in for avr-libc's interrupt.h. Handlers become plain functions
+ * that the host tools call directly. */
+
+#ifndef INC_HOST_INTERRUPT_H
+#define INC_HOST_INTERRUPT_H
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif
+
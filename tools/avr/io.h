@@ -0,0 +1,44 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Stand-in for avr-libc's io.h, with just the registers used by clock.c
+ * and c328.c. UART0 is wired to the camera emulator in tools/c3emu.c:
+ * a byte written to UDR0 is collected the next time UCSR0A is polled
+ * or the CPU sleeps, and received bytes are placed in UDR0 before the
+ * emulator calls the USART0_RX_vect handler. */
+
+#ifndef INC_HOST_IO_H
+#define INC_HOST_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+/* TIMER0 */
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0;
+#define WGM01  (1)
+#define CS00   (0)
+#define CS01   (1)
+#define OCIE0A (1)
+
+/* UART0. UDR0 holds UDR0_EMPTY when no byte is waiting to be sent */
+extern volatile uint8_t UCSR0B, UCSR0C, UBRR0H, UBRR0L;
+extern volatile uint16_t UDR0;
+extern uint8_t c3emu_ucsr0a(void);
+#define UCSR0A     (c3emu_ucsr0a())
+#define UDR0_EMPTY (0xFFFF)
+#define UDRE0  (5)
+#define RXCIE0 (7)
+#define RXEN0  (4)
+#define TXEN0  (3)
+#define UCSZ01 (2)
+#define UCSZ00 (1)
+
+#endif
+
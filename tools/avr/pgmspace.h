@@ -0,0 +1,32 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Stand-in for avr-libc's pgmspace.h, so the portable parts of the
+ * firmware (ssdv.c, rs8encode.c) can be built into the host tools.
+ * Program memory is just normal memory here. */
+
+#ifndef INC_HOST_PGMSPACE_H
+#define INC_HOST_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+#define pgm_read_word(p) (*(const uint16_t *) (p))
+
+#define memcpy_P  memcpy
+#define memcmp_P  memcmp
+#define strlen_P  strlen
+
+#endif
+
@@ -0,0 +1,23 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Stand-in for avr-libc's sleep.h. Sleeping moves the emulated time
+ * on by a millisecond, see tools/c3emu.c. */
+
+#ifndef INC_HOST_SLEEP_H
+#define INC_HOST_SLEEP_H
+
+#define SLEEP_MODE_IDLE (0)
+#define set_sleep_mode(mode)
+
+extern void c3emu_sleep(void);
+#define sleep_mode() c3emu_sleep()
+
+#endif
+
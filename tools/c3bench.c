@@ -0,0 +1,249 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Runs the firmware's camera driver against the emulated C328. Each
+ * snapshot is read 64 bytes at a time as the encoder would, optionally
+ * taking some time over each block, and resumed after errors as
+ * hadie.c does. What was read is checked against the JPEG served, and
+ * the time taken and the errors seen are reported. All times are
+ * emulated, so a run can be repeated exactly with the same seed.
+ * With -R raw snapshots are read in bands instead, as hadie.c does
+ * with IMG_RAW, and each band is checked against the frame. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "../config.h"
+#include "../clock.h"
+#include "../c328.h"
+#include "c3emu.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: c3bench [options] image.jpg [image.jpg ...]\n"
+		"       c3bench [options] -R 1|3\n"
+		"\n"
+		"  -n  Number of snapshots to read (default 10)\n"
+		"  -c  Encoder time in microseconds per byte read (default 0)\n"
+		"  -B  Camera baud rate at power up (default 14400)\n"
+		"  -s  SYNCs ignored at power up (default 5)\n"
+		"  -l  Camera response latency in ms (default 1)\n"
+		"  -p  Time to take a picture in ms (default 200)\n"
+		"  -e  Chance of each package byte being corrupted (default 0)\n"
+		"  -d  Chance of each package being dropped (default 0)\n"
+		"  -r  Seed for the errors (default 1)\n"
+		"  -R  Read raw snapshots, 1 = 80x60 or 3 = 160x120\n"
+		"  -P  Read JPEG previews instead of snapshots\n");
+}
+
+/* Read the raw snapshot band by band, returns the number of bands
+ * that didn't match the frame or -1 if reading failed */
+static int read_raw(uint16_t width, uint16_t height, long *retries)
+{
+	const uint8_t *frame;
+	uint8_t *band;
+	uint16_t x, y, ly, tries;
+	size_t length;
+	int bad = 0;
+	uint8_t n;
+	char r;
+	
+	frame = c3emu_snapshot(&length);
+	
+	for(y = 0; y < height; y += 8)
+	{
+		for(x = 0; x < width; x += n * 8)
+		{
+			n = (width - x) / 8;
+			if(n > 4) n = 4;
+			
+			for(tries = 0; ; tries++)
+			{
+				r = c3_request_band(x, y, n);
+				if(r == 0) while((r = c3_poll_band(&band)) == 1) clock_idle();
+				if(r == 0 || tries >= IMG_RESUMES) break;
+			}
+			
+			*retries += tries;
+			if(r != 0) return(-1);
+			
+			/* Lines past the bottom repeat the last */
+			for(ly = 0; ly < 8; ly++)
+			{
+				const uint8_t *l = frame + (y + ly < height ? y + ly : height - 1) * width + x;
+				if(memcmp(band + ly * n * 8, l, n * 8)) break;
+			}
+			
+			if(ly < 8) bad++;
+		}
+	}
+	
+	return(bad);
+}
+
+int main(int argc, char *argv[])
+{
+	c3emu_config_t cfg = { 14400, 5, 1, 200, 0, 0, 1 };
+	int snapshots = 10, cost = 0, rr = 0, preview = 0;
+	uint16_t width, height;
+	long ok = 0, corrupt = 0, failed = 0, resumes = 0;
+	uint32_t t, open_ms = 0, read_ms = 0, bytes = 0, busy = 0;
+	const uint8_t *jpeg;
+	uint8_t *buf;
+	size_t length;
+	uint16_t p, n;
+	int c, i, resumed;
+	char r;
+
+	while((c = getopt(argc, argv, "n:c:B:s:l:p:e:d:r:R:Ph")) != -1)
+	{
+		switch(c)
+		{
+		case 'n': snapshots = atoi(optarg); break;
+		case 'c': cost = atoi(optarg); break;
+		case 'B': cfg.baud = atol(optarg); break;
+		case 's': cfg.syncs = atoi(optarg); break;
+		case 'l': cfg.latency = atoi(optarg); break;
+		case 'p': cfg.picture_ms = atoi(optarg); break;
+		case 'e': cfg.corrupt = atof(optarg); break;
+		case 'd': cfg.drop = atof(optarg); break;
+		case 'r': cfg.seed = atol(optarg); break;
+		case 'R': rr = atoi(optarg); break;
+		case 'P': preview = 1; break;
+		default: usage(); return(-1);
+		}
+	}
+
+	if((optind == argc && !rr) || snapshots < 1 || cfg.baud < 1200 ||
+	   (rr && rr != PR_80x60 && rr != PR_160x120))
+	{
+		usage();
+		return(-1);
+	}
+
+	if(c3emu_init(&cfg, &argv[optind], argc - optind) != 0) return(-1);
+
+	clock_init();
+	c3_init();
+
+	for(i = 0; i < snapshots && rr; i++)
+	{
+		t = clock_ms();
+		if((r = c3_open_raw(rr, &width, &height)) != 0)
+		{
+			fprintf(stderr, "Snapshot %d: c3_open_raw() failed (%i)\n", i, r);
+			failed++;
+			continue;
+		}
+		
+		open_ms += clock_ms() - t;
+		t = clock_ms();
+		
+		c = read_raw(width, height, &resumes);
+		read_ms += clock_ms() - t;
+		
+		if(c < 0)
+		{
+			fprintf(stderr, "Snapshot %d: Read failed\n", i);
+			failed++;
+		}
+		else if(c > 0)
+		{
+			fprintf(stderr, "Snapshot %d: %d bands don't match\n", i, c);
+			corrupt++;
+		}
+		else
+		{
+			bytes += width * height;
+			ok++;
+		}
+		
+		c3_close();
+	}
+	
+	for(i = 0; i < snapshots && !rr; i++)
+	{
+		t = clock_ms();
+		r = preview ? c3_open_preview(SR_160x128) : c3_open(SR_320x240);
+		if(r != 0)
+		{
+			fprintf(stderr, "Snapshot %d: Open failed (%i)\n", i, r);
+			failed++;
+			continue;
+		}
+
+		open_ms += clock_ms() - t;
+		t = clock_ms();
+
+		jpeg = c3emu_snapshot(&length);
+		buf = calloc(length, 1);
+		resumed = 0;
+
+		while(!c3_eof())
+		{
+			while((r = c3_fetch()) == 1) clock_idle();
+
+			if(r < 0)
+			{
+				/* Packages already read are read again, that's fine
+				 * here as they go back into the same place */
+				if(resumed++ >= IMG_RESUMES) break;
+				c3_resume(c3_package_id());
+				continue;
+			}
+
+			p = c3_tell();
+			n = c3_read_nb(buf + p, 64);
+
+			/* The encoder's turn */
+			busy += n * cost;
+			c3emu_run(busy / 1000);
+			busy %= 1000;
+		}
+
+		read_ms += clock_ms() - t;
+		resumes += resumed;
+
+		if(!c3_eof())
+		{
+			fprintf(stderr, "Snapshot %d: Read failed at byte %u of %u\n", i, c3_tell(), c3_filesize());
+			failed++;
+		}
+		else if(length != c3_filesize() || memcmp(buf, jpeg, length))
+		{
+			fprintf(stderr, "Snapshot %d: Data doesn't match\n", i);
+			corrupt++;
+		}
+		else
+		{
+			bytes += length;
+			ok++;
+		}
+
+		c3_close();
+		free(buf);
+	}
+
+	printf("Snapshots:  %ld ok, %ld corrupt, %ld failed, %ld resumes\n",
+		ok, corrupt, failed, resumes);
+	printf("Camera:     %lu baud, %ld commands, %ld bytes garbled\n",
+		(unsigned long) c3_baud(), c3emu_stats.commands, c3emu_stats.garbled);
+	printf("Packages:   %ld sent, %ld repeated, %ld corrupted, %ld dropped\n",
+		c3emu_stats.packages, c3emu_stats.repeats, c3emu_stats.corrupted, c3emu_stats.dropped);
+	printf("Time:       %.1f ms to open, %.1f ms to read\n",
+		(double) open_ms / snapshots, (double) read_ms / snapshots);
+	if(read_ms > 0)
+		printf("Throughput: %.0f bytes/s\n", bytes * 1000.0 / read_ms);
+
+	return(0);
+}
+
@@ -0,0 +1,465 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Emulated C328 camera, see c3emu.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include "../config.h"
+#include "../c328.h"
+#include "c3emu.h"
+
+/* The registers the firmware sees */
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, TIMSK0;
+volatile uint8_t UCSR0B, UCSR0C, UBRR0H, UBRR0L;
+volatile uint16_t UDR0 = UDR0_EMPTY;
+
+/* The firmware's interrupt handlers */
+extern void TIMER0_COMPA_vect(void);
+extern void USART0_RX_vect(void);
+
+c3emu_stats_t c3emu_stats;
+
+static c3emu_config_t cfg;
+
+/* The camera's clock, baud rates are divided down from this */
+#define C3_CLOCK (14745600 / 4)
+
+/* Rates further apart than this can't talk to each other */
+#define BAUD_TOLERANCE (0.02)
+
+/* Bytes waiting to be sent, and when each may go */
+#define OUT_LEN (32768)
+
+typedef struct {
+	uint8_t b;
+	uint32_t t;
+} out_t;
+
+static out_t out[OUT_LEN];
+static int out_head, out_tail;
+static double out_credit;
+
+static uint32_t now;
+static long baud, baud_next;
+static int syncs;
+
+/* The command being received */
+static uint8_t cmd[6];
+static int cmd_len;
+
+/* The images */
+typedef struct {
+	uint8_t *data;
+	size_t length;
+} image_t;
+
+static image_t *images;
+static int images_n;
+static int image;    /* The last snapshot, -1 if none */
+static int pkg_size;
+static long last_id;
+
+/* Raw frames are made up, a pattern that moves with each snapshot */
+static uint8_t ct, rr;
+static uint8_t raw[160 * 120];
+static int raw_width, raw_height, raw_snap, snaps;
+
+static uint32_t prng_state;
+
+static uint32_t prng(void)
+{
+	prng_state ^= prng_state << 13;
+	prng_state ^= prng_state >> 17;
+	prng_state ^= prng_state << 5;
+	return(prng_state);
+}
+
+static int chance(double p)
+{
+	return(prng() < p * 4294967296.0);
+}
+
+static long host_baud(void)
+{
+	return(F_CPU / 16 / (UBRR0L + 1));
+}
+
+static int baud_match(void)
+{
+	double d = (double) (host_baud() - baud) / baud;
+	return(d < BAUD_TOLERANCE && d > -BAUD_TOLERANCE);
+}
+
+static void send(const uint8_t *b, int n, int delay)
+{
+	uint32_t t = now + delay;
+
+	/* Responses go in order, after anything already queued */
+	if(out_head != out_tail && out[(out_head + OUT_LEN - 1) % OUT_LEN].t > t)
+		t = out[(out_head + OUT_LEN - 1) % OUT_LEN].t;
+
+	while(n--)
+	{
+		if((out_head + 1) % OUT_LEN == out_tail)
+		{
+			fprintf(stderr, "c3emu: Output queue full\n");
+			exit(-1);
+		}
+
+		out[out_head].b = *(b++);
+		out[out_head].t = t;
+		out_head = (out_head + 1) % OUT_LEN;
+	}
+}
+
+static void send_cmd(uint8_t c, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, int delay)
+{
+	uint8_t b[6] = { 0xAA, c, a1, a2, a3, a4 };
+	send(b, 6, delay);
+}
+
+static void ack(uint8_t c)
+{
+	send_cmd(CMD_ACK, c, 0, 0, 0, cfg.latency);
+}
+
+static void nak(uint8_t err)
+{
+	send_cmd(CMD_NAK, 0, 0, err, 0, cfg.latency);
+}
+
+static void send_package(long id)
+{
+	image_t *img = &images[image];
+	size_t offset = id * (pkg_size - 6);
+	uint8_t pkg[4096];
+	uint8_t sum = 0;
+	int i, n;
+
+	if(offset >= img->length)
+	{
+		nak(ERR_TRANSFER_PACKAGE_NUMBER_ERROR);
+		return;
+	}
+
+	n = pkg_size - 6;
+	if(n > img->length - offset) n = img->length - offset;
+
+	pkg[0] = id & 0xFF;
+	pkg[1] = id >> 8;
+	pkg[2] = n & 0xFF;
+	pkg[3] = n >> 8;
+	memcpy(&pkg[4], &img->data[offset], n);
+
+	/* The checksum is the low byte of the sum of everything before it */
+	for(i = 0; i < n + 4; i++) sum += pkg[i];
+	pkg[n + 4] = sum;
+	pkg[n + 5] = 0;
+
+	if(id == last_id) c3emu_stats.repeats++;
+	last_id = id;
+
+	if(chance(cfg.drop))
+	{
+		c3emu_stats.dropped++;
+		return;
+	}
+
+	if(chance(cfg.corrupt * (n + 6)))
+	{
+		pkg[prng() % (n + 6)] ^= 1 << (prng() % 8);
+		c3emu_stats.corrupted++;
+	}
+
+	c3emu_stats.packages++;
+	send(pkg, n + 6, cfg.latency);
+}
+
+static void raw_frame(void)
+{
+	int x, y, v;
+	
+	raw_width  = rr == PR_160x120 ? 160 : 80;
+	raw_height = rr == PR_160x120 ? 120 : 60;
+	
+	/* A gradient and some shapes, moved along each time */
+	for(y = 0; y < raw_height; y++)
+	{
+		for(x = 0; x < raw_width; x++)
+		{
+			v = (x + y + snaps * 4) % 256 / 2 + 32;
+			if(((x - snaps) / 16 + y / 16) % 3 == 0) v += 64;
+			if((x - raw_width / 2) * (x - raw_width / 2) + (y - raw_height / 2) * (y - raw_height / 2) < raw_height * raw_height / 16) v = 240;
+			raw[y * raw_width + x] = v;
+		}
+	}
+	
+	snaps++;
+	raw_snap = 1;
+}
+
+static void command(void)
+{
+	uint16_t i;
+
+	c3emu_stats.commands++;
+
+	/* Nothing is answered until the camera has seen enough SYNCs */
+	if(syncs < cfg.syncs)
+	{
+		if(cmd[1] == CMD_SYNC) syncs++;
+		return;
+	}
+
+	switch(cmd[1])
+	{
+	case CMD_SYNC:
+		ack(CMD_SYNC);
+		send_cmd(CMD_SYNC, 0, 0, 0, 0, 0);
+		break;
+
+	case CMD_ACK:
+		/* The host's ACK of a SYNC, or a request for a package */
+		if(cmd[2] != 0) break;
+
+		i = cmd[4] + (cmd[5] << 8);
+		if(i == 0xF0F0) last_id = -1;
+		else if(image >= 0) send_package(i);
+		break;
+
+	case CMD_INIT:
+		if(cmd[3] != CT_JPEG && (cmd[3] != CT_8BIT_GRAY ||
+		   (cmd[4] != PR_80x60 && cmd[4] != PR_160x120)))
+		{
+			nak(ERR_PARAMETER_ERROR);
+			break;
+		}
+		
+		ct = cmd[3];
+		rr = cmd[4];
+		ack(CMD_INIT);
+		break;
+
+	case CMD_SET_PKG_SIZE:
+		i = cmd[3] + (cmd[4] << 8);
+		if(i < 64 || i > 512) nak(ERR_SET_TRANSFER_PACKAGE_SIZE_WRONG);
+		else
+		{
+			pkg_size = i;
+			ack(CMD_SET_PKG_SIZE);
+		}
+		break;
+
+	case CMD_SET_BAUDRATE:
+		/* The ACK goes at the old rate, then the camera switches */
+		ack(CMD_SET_BAUDRATE);
+		baud_next = C3_CLOCK / (cmd[2] + 1) / (cmd[3] + 1);
+		break;
+
+	case CMD_SNAPSHOT:
+		if(cmd[2] == ST_RAW && ct == CT_8BIT_GRAY) raw_frame();
+		else if(cmd[2] == ST_JPEG && ct == CT_JPEG && images_n > 0)
+		{
+			image = (image + 1) % images_n;
+			raw_snap = 0;
+		}
+		else
+		{
+			nak(ERR_PICTURE_TYPE_ERROR);
+			break;
+		}
+		
+		ack(CMD_SNAPSHOT);
+		break;
+
+	case CMD_GET_PICTURE:
+		if(raw_snap && cmd[2] == PT_SNAPSHOT)
+		{
+			/* The pixels follow the DATA response, all at once */
+			ack(CMD_GET_PICTURE);
+			i = raw_width * raw_height;
+			send_cmd(CMD_DATA, cmd[2], i & 0xFF, i >> 8, 0, cfg.picture_ms);
+			send(raw, i, 0);
+			break;
+		}
+		
+		/* Previews are a new picture each time */
+		if(cmd[2] == PT_JPEG_PREVIEW && ct == CT_JPEG && images_n > 0)
+		{
+			image = (image + 1) % images_n;
+			raw_snap = 0;
+		}
+		else if(image < 0 || raw_snap || cmd[2] != PT_SNAPSHOT)
+		{
+			nak(ERR_PICTURE_TYPE_ERROR);
+			break;
+		}
+
+		ack(CMD_GET_PICTURE);
+		send_cmd(CMD_DATA, cmd[2],
+			images[image].length & 0xFF,
+			(images[image].length >> 8) & 0xFF,
+			(images[image].length >> 16) & 0xFF,
+			cfg.picture_ms);
+		last_id = -1;
+		break;
+
+	default:
+		nak(ERR_COMMAND_ID_ERROR);
+		break;
+	}
+}
+
+static void receive(void)
+{
+	uint8_t b;
+
+	/* Collect a byte the firmware has written to UDR0 */
+	if(UDR0 == UDR0_EMPTY) return;
+	b = UDR0;
+	UDR0 = UDR0_EMPTY;
+
+	if(!baud_match())
+	{
+		c3emu_stats.garbled++;
+		return;
+	}
+
+	/* Commands all begin with 0xAA */
+	if(cmd_len == 0 && b != 0xAA) return;
+
+	cmd[cmd_len++] = b;
+	if(cmd_len < 6) return;
+
+	cmd_len = 0;
+	command();
+}
+
+uint8_t c3emu_ucsr0a(void)
+{
+	/* The transmit buffer is always free once the last byte is taken */
+	receive();
+	return(_BV(UDRE0));
+}
+
+void c3emu_run(uint32_t ms)
+{
+	while(ms--)
+	{
+		receive();
+
+		now++;
+		TIMER0_COMPA_vect();
+
+		/* Send as many bytes as fit in a millisecond */
+		out_credit += baud / 10000.0;
+
+		while(out_tail != out_head && out[out_tail].t <= now && out_credit >= 1)
+		{
+			out_credit -= 1;
+
+			if(baud_match())
+			{
+				UDR0 = out[out_tail].b;
+				USART0_RX_vect();
+				UDR0 = UDR0_EMPTY;
+			}
+			else c3emu_stats.garbled++;
+
+			c3emu_stats.bytes++;
+			out_tail = (out_tail + 1) % OUT_LEN;
+		}
+
+		/* Credit doesn't build up while idle */
+		if(out_tail == out_head || out[out_tail].t > now)
+		{
+			if(out_credit > 1) out_credit = 1;
+
+			/* A new rate takes effect once the ACK has gone */
+			if(out_tail == out_head && baud_next)
+			{
+				baud = baud_next;
+				baud_next = 0;
+			}
+		}
+	}
+}
+
+void c3emu_sleep(void)
+{
+	c3emu_run(1);
+}
+
+const uint8_t *c3emu_snapshot(size_t *length)
+{
+	if(raw_snap)
+	{
+		*length = raw_width * raw_height;
+		return(raw);
+	}
+	
+	if(image < 0) return(NULL);
+	*length = images[image].length;
+	return(images[image].data);
+}
+
+int c3emu_init(const c3emu_config_t *config, char *files[], int n)
+{
+	int i, c;
+
+	cfg = *config;
+	prng_state = cfg.seed ? cfg.seed : 1;
+	baud = cfg.baud;
+	baud_next = 0;
+	syncs = 0;
+	cmd_len = 0;
+	out_head = out_tail = 0;
+	out_credit = 0;
+	image = -1;
+	pkg_size = 64;
+	last_id = -1;
+	ct = CT_JPEG;
+	raw_snap = snaps = 0;
+	memset(&c3emu_stats, 0, sizeof(c3emu_stats));
+
+	/* Load the images */
+	images = calloc(n ? n : 1, sizeof(image_t));
+	images_n = n;
+
+	for(i = 0; i < n; i++)
+	{
+		FILE *f = fopen(files[i], "rb");
+		if(!f)
+		{
+			perror(files[i]);
+			return(-1);
+		}
+
+		while((c = fgetc(f)) != EOF)
+		{
+			images[i].data = realloc(images[i].data, images[i].length + 1);
+			images[i].data[images[i].length++] = c;
+		}
+
+		fclose(f);
+
+		if(images[i].length == 0 || images[i].length > 0xFFFF)
+		{
+			fprintf(stderr, "%s: Must be 1 to 65535 bytes\n", files[i]);
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
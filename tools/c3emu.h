@@ -0,0 +1,60 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Emulated C328 camera for the host tools. The firmware's c328.c and
+ * clock.c are built against the stand-in headers in tools/avr/, with
+ * UART0 wired to the emulator. Time is emulated too: each sleep of the
+ * CPU is one millisecond, in which the camera sends as many bytes as
+ * its baud rate allows. Snapshots and JPEG previews are served from
+ * JPEG files in turn, and errors and delays can be added to packages
+ * and responses. Raw 8-bit grey snapshots are a made up pattern. */
+
+#ifndef INC_C3EMU_H
+#define INC_C3EMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+	long baud;        /* The camera's rate at power up, bps             */
+	int syncs;        /* SYNCs ignored at power up before answering     */
+	int latency;      /* ms before each response                        */
+	int picture_ms;   /* ms between GET_PICTURE and the DATA response   */
+	double corrupt;   /* Chance of a byte being corrupted in a package  */
+	double drop;      /* Chance of a package not being sent at all      */
+	uint32_t seed;    /* For the errors, the same seed gives the same run */
+} c3emu_config_t;
+
+typedef struct
+{
+	long commands;    /* Commands received                              */
+	long garbled;     /* Bytes lost to a baud rate mismatch             */
+	long packages;    /* Packages sent                                  */
+	long repeats;     /* Packages requested again                       */
+	long corrupted;   /* Packages sent with a corrupted byte            */
+	long dropped;     /* Packages not sent                              */
+	long bytes;       /* Bytes sent by the camera                       */
+} c3emu_stats_t;
+
+extern c3emu_stats_t c3emu_stats;
+
+/* Power up the camera. The files are served by SNAPSHOT in turn */
+extern int c3emu_init(const c3emu_config_t *cfg, char *files[], int n);
+
+/* Let ms milliseconds of emulated time pass, as the CPU would while
+ * working on something else */
+extern void c3emu_run(uint32_t ms);
+
+/* The image of the last snapshot, to check what the firmware read.
+ * For a raw snapshot this is the pixels, width * height bytes */
+extern const uint8_t *c3emu_snapshot(size_t *length);
+
+#endif
+
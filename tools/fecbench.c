@@ -0,0 +1,319 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Benchmark of the FEC settings. Each JPEG in a corpus is encoded with
+ * ssdv.c for every combination of RS codes per packet and repair
+ * packets per group, the packets are passed through a bit error
+ * channel, with or without bursts, and decoded with the RS codes and
+ * repair packets. The rate of complete images and the goodput (the
+ * image payload delivered per second of airtime) are reported for each
+ * combination. Jobs are spread over a number of threads.
+ *
+ * SSDV packets are always SSDV_PKT_SIZE (256) bytes, a sync byte and
+ * one RS(255) block, so the packet size itself can't be swept. The RS
+ * codes set the payload in each packet: 205, 221 or 229 bytes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../config.h"
+#include "../ssdv.h"
+#include "ssdvrx.h"
+
+#define MAX_CHANNELS (16)
+
+static const uint8_t rscodes[] = { 32, 16, 8 };
+static const uint8_t repairs[] = { 0, 1, 2, 4 };
+#define N_RSCODES (sizeof(rscodes))
+#define N_REPAIRS (sizeof(repairs))
+
+/* Options */
+static int group = 16, trials = 20, burst = 0;
+static double ber[MAX_CHANNELS];
+static int channels = 0;
+
+/* The corpus */
+typedef struct {
+	const char *name;
+	uint8_t *data;
+	size_t length;
+} image_t;
+
+static image_t *corpus;
+static int images;
+
+/* Results for each setting and channel */
+typedef struct {
+	long sent;      /* Images sent                         */
+	long complete;  /* Images received complete            */
+	long packets;   /* Packets sent, including repair      */
+	long payload;   /* Image payload bytes delivered       */
+} result_t;
+
+static result_t results[N_RSCODES][N_REPAIRS][MAX_CHANNELS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_job = 0;
+
+/* xorshift, each job has its own state so the threads don't share rand() */
+static uint32_t prng(uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return(*s);
+}
+
+static int chance(uint32_t *s, double p)
+{
+	return(prng(s) < p * 4294967296.0);
+}
+
+/* Encode an image, returns the number of packets or -1 on error */
+static int encode(image_t *img, uint8_t rs, uint8_t rp, uint8_t **out)
+{
+	uint8_t *rpbuf = malloc(rp * SSDV_PKT_SIZE_REPAIR + 1);
+	uint8_t pkt[SSDV_PKT_SIZE];
+	size_t i = 0, l;
+	ssdv_t ssdv;
+	int n = 0;
+	char r;
+	
+	ssdv_enc_init(&ssdv, CALLSIGN, 0);
+	ssdv_enc_set_rscodes(&ssdv, rs);
+	ssdv_enc_set_buffer(&ssdv, pkt);
+	ssdv_enc_set_repair(&ssdv, rpbuf, group, rp);
+	
+	*out = NULL;
+	
+	while(1)
+	{
+		while((r = ssdv_enc_get_packet(&ssdv)) == SSDV_FEED_ME)
+		{
+			/* Fed 64 bytes at a time, as the firmware does */
+			l = img->length - i;
+			if(l == 0) break;
+			if(l > 64) l = 64;
+			ssdv_enc_feed(&ssdv, &img->data[i], l);
+			i += l;
+		}
+		
+		if(r != SSDV_OK) break;
+		
+		*out = realloc(*out, (n + 1) * SSDV_PKT_SIZE);
+		memcpy(&(*out)[n++ * SSDV_PKT_SIZE], pkt, SSDV_PKT_SIZE);
+	}
+	
+	free(rpbuf);
+	
+	return(r == SSDV_EOI ? n : -1);
+}
+
+/* Flip bits at the channel's error rate. With bursts, errors come in
+ * runs averaging 'burst' bits at a BER of 0.5, frequent enough to give
+ * the same overall error rate */
+static void channel(uint8_t *pkt, double p, uint32_t *s, int *bad)
+{
+	double enter = 0;
+	int i, j;
+	
+	if(burst > 0) enter = (2 * p / burst) / (1 - 2 * p);
+	
+	for(i = 0; i < SSDV_PKT_SIZE; i++)
+	{
+		for(j = 0; j < 8; j++)
+		{
+			if(burst > 0)
+			{
+				if(*bad) *bad = !chance(s, 1.0 / burst);
+				else *bad = chance(s, enter);
+				
+				if(*bad && chance(s, 0.5)) pkt[i] ^= 1 << j;
+			}
+			else if(chance(s, p)) pkt[i] ^= 1 << j;
+		}
+	}
+}
+
+static void run_job(int job, ssdvrx_t *rx)
+{
+	int im = job % images;
+	int rs = job / images % N_RSCODES;
+	int rp = job / images / N_RSCODES % N_REPAIRS;
+	int ch = job / images / N_RSCODES / N_REPAIRS;
+	result_t res = { 0, 0, 0, 0 };
+	uint8_t *pkts, buf[SSDV_PKT_SIZE];
+	uint32_t seed = job * 2654435761u + 1;
+	int n, nd, t, i, good, bad = 0;
+	
+	n = encode(&corpus[im], rscodes[rs], repairs[rp], &pkts);
+	if(n < 0)
+	{
+		fprintf(stderr, "%s: ssdv_enc_get_packet() failed\n", corpus[im].name);
+		free(pkts);
+		return;
+	}
+	
+	/* Count the image packets, leaving out the repair packets */
+	for(nd = i = 0; i < n; i++)
+		if(((pkts[i * SSDV_PKT_SIZE + 1] - SSDV_TYPE_NORMAL) & 1) == 0) nd++;
+	
+	for(t = 0; t < trials; t++)
+	{
+		ssdvrx_init(rx);
+		
+		for(i = 0; i < n; i++)
+		{
+			memcpy(buf, &pkts[i * SSDV_PKT_SIZE], SSDV_PKT_SIZE);
+			channel(buf, ber[ch], &seed, &bad);
+			if(ssdvrx_check(buf, NULL) > 0) ssdvrx_add(rx, buf);
+		}
+		
+		ssdvrx_recover(rx);
+		
+		good = ssdvrx_count(rx, 0);
+		res.sent++;
+		res.packets += n;
+		res.payload += good * (SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - rscodes[rs]);
+		if(good == nd) res.complete++;
+		
+		ssdvrx_free(rx);
+	}
+	
+	free(pkts);
+	
+	pthread_mutex_lock(&lock);
+	results[rs][rp][ch].sent += res.sent;
+	results[rs][rp][ch].complete += res.complete;
+	results[rs][rp][ch].packets += res.packets;
+	results[rs][rp][ch].payload += res.payload;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+	ssdvrx_t *rx = malloc(sizeof(ssdvrx_t));
+	int jobs = images * N_RSCODES * N_REPAIRS * channels;
+	int job;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&lock);
+		job = next_job++;
+		pthread_mutex_unlock(&lock);
+		
+		if(job >= jobs) break;
+		run_job(job, rx);
+	}
+	
+	free(rx);
+	
+	return(NULL);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: fecbench [options] image.jpg [image.jpg ...]\n"
+		"\n"
+		"  -e  Bit error rate, may be given more than once (default 1e-3)\n"
+		"  -B  Mean burst length in bits, 0 for independent errors (default 0)\n"
+		"  -g  Image packets per repair group (default %d)\n"
+		"  -n  Trials for each image and setting (default %d)\n"
+		"  -j  Number of threads (default one per CPU)\n",
+		group, trials);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	int threads_n = sysconf(_SC_NPROCESSORS_ONLN);
+	double airtime;
+	int c, i, rs, rp, ch;
+	
+	while((c = getopt(argc, argv, "e:B:g:n:j:h")) != -1)
+	{
+		switch(c)
+		{
+		case 'e':
+			if(channels < MAX_CHANNELS) ber[channels++] = atof(optarg);
+			break;
+		case 'B': burst = atoi(optarg); break;
+		case 'g': group = atoi(optarg); break;
+		case 'n': trials = atoi(optarg); break;
+		case 'j': threads_n = atoi(optarg); break;
+		default: usage(); return(-1);
+		}
+	}
+	
+	if(optind == argc || group < 1 || group > 64 || trials < 1 || threads_n < 1)
+	{
+		usage();
+		return(-1);
+	}
+	
+	if(channels == 0) ber[channels++] = 1e-3;
+	
+	/* Load the corpus */
+	images = argc - optind;
+	corpus = calloc(images, sizeof(image_t));
+	
+	for(i = 0; i < images; i++)
+	{
+		FILE *f = fopen(argv[optind + i], "rb");
+		if(!f)
+		{
+			perror(argv[optind + i]);
+			return(-1);
+		}
+		
+		corpus[i].name = argv[optind + i];
+		while((c = fgetc(f)) != EOF)
+		{
+			corpus[i].data = realloc(corpus[i].data, corpus[i].length + 1);
+			corpus[i].data[corpus[i].length++] = c;
+		}
+		
+		fclose(f);
+	}
+	
+	threads = malloc(threads_n * sizeof(pthread_t));
+	for(i = 0; i < threads_n; i++) pthread_create(&threads[i], NULL, worker, NULL);
+	for(i = 0; i < threads_n; i++) pthread_join(threads[i], NULL);
+	
+	printf("%d images, %d trials, %d packet groups, %s errors, %d baud, %g stop bits\n",
+		images, trials, group, burst ? "burst" : "independent", RTTY_BAUD, (double) RTTY_STOPBITS);
+	printf("     BER  RS  RP  complete   goodput\n");
+	
+	for(ch = 0; ch < channels; ch++)
+	{
+		for(rs = 0; rs < N_RSCODES; rs++)
+		{
+			for(rp = 0; rp < N_REPAIRS; rp++)
+			{
+				result_t *r = &results[rs][rp][ch];
+				
+				if(r->sent == 0) continue;
+				
+				/* Airtime of the packets alone, telemetry is not counted */
+				airtime = r->packets * SSDV_PKT_SIZE * (9.0 + RTTY_STOPBITS) / RTTY_BAUD;
+				
+				printf("%8.1e  %2d  %2d  %7.2f%%  %5.1f bit/s\n",
+					ber[ch], rscodes[rs], repairs[rp],
+					100.0 * r->complete / r->sent,
+					r->payload * 8.0 / airtime);
+			}
+		}
+	}
+	
+	return(0);
+}
+
@@ -0,0 +1,522 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* End to end loopback of the downlink. The byte stream the firmware
+ * would queue with rtx_data() is built from JPEG files with ssdv.c and
+ * the settings in config.h, or read from a file. It is modulated as
+ * RTTY (start bit, 8 data bits LSB first, RTTY_STOPBITS stop bits) or
+ * as MFSK with mfsk.c, passed through a channel with white noise and
+ * Rayleigh fading, demodulated, and the SSDV packets recovered with the
+ * RS codes and repair packets. Packet loss and the number of complete
+ * images per hour are reported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "../config.h"
+#include "../ssdv.h"
+#include "../mfsk.h"
+#include "ssdvrx.h"
+
+#define SAMPLE_RATE (MFSK_SAMPLE_RATE)
+#define CENTRE_TONE (1500.0)
+#define BASE_TONE   ((double) MFSK_BASE_TONE)
+
+#ifndef SSDV_GROUP
+#define SSDV_GROUP  (16)
+#endif
+#ifndef SSDV_REPAIR
+#define SSDV_REPAIR (0)
+#endif
+
+/* Options */
+static int tones = 0, baud = RTTY_BAUD, tlm_period = TLM_PERIOD;
+static double stopbits = RTTY_STOPBITS, shift = 600, snr = 100, fade = 0;
+
+/* Byte streams */
+static uint8_t *tx, *rx;
+static size_t tx_len, rx_len, rx_size;
+
+static double gauss(void)
+{
+	/* Box-Muller */
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return(sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v));
+}
+
+static void tx_put(const void *data, size_t length)
+{
+	tx = realloc(tx, tx_len + length);
+	memcpy(&tx[tx_len], data, length);
+	tx_len += length;
+}
+
+static void rx_put(uint8_t b)
+{
+	if(rx_len == rx_size) rx = realloc(rx, rx_size += 4096);
+	rx[rx_len++] = b;
+}
+
+/* A telemetry line of the same length as the real thing */
+static void tx_telemetry(void)
+{
+	static unsigned int counter = 0;
+	char msg[100];
+	uint16_t x;
+	char *p;
+	int i;
+	
+	snprintf(msg, sizeof(msg), "$$" CALLSIGN ",%u,12:34:56,52.123456,-1.123456,12345,3,8,?", counter++);
+	
+	/* CRC16-CCITT (xmodem), skipping the $$ prefix */
+	for(x = 0xFFFF, p = msg + 2; *p; p++)
+	{
+		x ^= (uint16_t) *p << 8;
+		for(i = 0; i < 8; i++) x = (x & 0x8000 ? (x << 1) ^ 0x1021 : x << 1);
+	}
+	
+	sprintf(p, "*%04X\n", x);
+	tx_put(msg, strlen(msg));
+}
+
+/* Seconds of airtime for n bytes */
+static double airtime_s(size_t n)
+{
+	if(tones == 0) return(n * (9 + stopbits) / baud);
+	return(n * 8.0 / (baud * (tones == 8 ? 3 : 2)));
+}
+
+/* Queue a packet as task_send() in hadie.c does. A telemetry line goes
+ * first if the packet would end after the line is due (tlm_due()),
+ * and the next is due tlm_period seconds later. The radio is taken to
+ * be busy all the time, so the clock is the end of the queued data */
+static void tx_packet(const uint8_t *pkt)
+{
+	static double tlm_next = 0;
+	
+	if(airtime_s(tx_len + SSDV_PKT_SIZE + 1) >= tlm_next)
+	{
+		tx_telemetry();
+		tlm_next = airtime_s(tx_len) + tlm_period;
+	}
+	
+	tx_put(pkt, SSDV_PKT_SIZE);
+	tx_put("\n", 1);
+}
+
+/* Encode an image in the same way as the firmware, with telemetry
+ * every tlm_period seconds */
+static int tx_image(const char *filename, uint8_t image_id)
+{
+	static uint8_t rpbuf[SSDV_REPAIR * SSDV_PKT_SIZE_REPAIR + 1];
+	uint8_t pkt[SSDV_PKT_SIZE], img[64];
+	ssdv_t ssdv;
+	FILE *f;
+	size_t l;
+	char r;
+	
+	f = fopen(filename, "rb");
+	if(!f)
+	{
+		perror(filename);
+		return(-1);
+	}
+	
+	ssdv_enc_init(&ssdv, CALLSIGN, image_id);
+	ssdv_enc_set_rscodes(&ssdv, SSDV_RSCODES);
+	ssdv_enc_set_buffer(&ssdv, pkt);
+	ssdv_enc_set_repair(&ssdv, rpbuf, SSDV_GROUP, SSDV_REPAIR);
+	
+	while(1)
+	{
+		while((r = ssdv_enc_get_packet(&ssdv)) == SSDV_FEED_ME)
+		{
+			l = fread(img, 1, sizeof(img), f);
+			if(l == 0) break;
+			ssdv_enc_feed(&ssdv, img, l);
+		}
+		
+		if(r != SSDV_OK) break;
+		
+		tx_packet(pkt);
+	}
+	
+	fclose(f);
+	
+	if(r != SSDV_EOI)
+	{
+		fprintf(stderr, "%s: ssdv_enc_get_packet() failed\n", filename);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+/* The channel: Rayleigh fading at 'fade' Hz and white noise. The tone
+ * has a power of 0.5, the SNR is measured in 2500 Hz */
+static double channel(double x)
+{
+	static double fi = 1, fq = 1;
+	static double sigma = -1, a;
+	
+	if(sigma < 0)
+	{
+		sigma = sqrt(0.5 / pow(10, snr / 10.0) * (SAMPLE_RATE / 2) / 2500.0);
+		a = exp(-2.0 * M_PI * fade / SAMPLE_RATE);
+	}
+	
+	if(fade > 0)
+	{
+		fi = a * fi + sqrt(1 - a * a) * gauss();
+		fq = a * fq + sqrt(1 - a * a) * gauss();
+		x *= sqrt((fi * fi + fq * fq) / 2);
+	}
+	
+	return(x + sigma * gauss());
+}
+
+/* RTTY demodulator. Each tone is mixed down and summed over one bit,
+ * the stronger tone gives the bit. The UART looks for the start of a
+ * start bit and samples each bit after one full window */
+static long rtty_framing = 0;
+
+static void rtty_rx(double x, double spb)
+{
+	static double mk[2], sp[2];
+	static double *ring = NULL;
+	static double pm = 0, ps = 0, next;
+	static int n, len, state = 0, k;
+	static long t = 0;
+	static uint8_t b;
+	double *r, d;
+	
+	if(!ring)
+	{
+		len = (int) (spb + 0.5);
+		ring = calloc(len * 4, sizeof(double));
+		n = 0;
+	}
+	
+	/* Sliding sums of each mixed tone over one bit */
+	r = &ring[n * 4];
+	mk[0] -= r[0]; mk[1] -= r[1];
+	sp[0] -= r[2]; sp[1] -= r[3];
+	
+	r[0] = x * cos(pm); r[1] = x * sin(pm);
+	r[2] = x * cos(ps); r[3] = x * sin(ps);
+	
+	mk[0] += r[0]; mk[1] += r[1];
+	sp[0] += r[2]; sp[1] += r[3];
+	
+	if(++n == len) n = 0;
+	pm = fmod(pm + 2.0 * M_PI * (CENTRE_TONE + shift / 2) / SAMPLE_RATE, 2.0 * M_PI);
+	ps = fmod(ps + 2.0 * M_PI * (CENTRE_TONE - shift / 2) / SAMPLE_RATE, 2.0 * M_PI);
+	
+	/* Positive for mark, negative for space */
+	d = mk[0] * mk[0] + mk[1] * mk[1]
+	  - sp[0] * sp[0] - sp[1] * sp[1];
+	
+	t++;
+	
+	if(state == 0)
+	{
+		/* Hunting for a start bit. The sums lag the edge by half a bit */
+		if(d >= 0) return;
+		
+		next = t - len / 2.0 + spb;
+		state = 1;
+		k = 0;
+		b = 0;
+		return;
+	}
+	
+	if(t < next) return;
+	next += spb;
+	
+	if(k == 0)
+	{
+		/* A false start if this isn't still space */
+		if(d >= 0) state = 0;
+	}
+	else if(k <= 8)
+	{
+		if(d >= 0) b |= 1 << (k - 1);
+	}
+	else
+	{
+		if(d < 0) rtty_framing++;
+		rx_put(b);
+		state = 0;
+	}
+	
+	k++;
+}
+
+static void rtty_loopback(void)
+{
+	double spb = (double) SAMPLE_RATE / baud;
+	double t = 0, end = 0, ph = 0;
+	size_t i;
+	int j, bit;
+	
+	for(i = 0; i < tx_len; i++)
+	{
+		for(j = 0; j < 10; j++)
+		{
+			/* Start bit, 8 data bits LSB first, then the stop bits */
+			if(j == 0) bit = 0;
+			else if(j < 9) bit = (tx[i] >> (j - 1)) & 1;
+			else bit = 1;
+			
+			end += (j < 9 ? 1 : stopbits) * spb;
+			
+			/* Continuous phase FSK, mark is the higher tone */
+			for(; t < end; t++)
+			{
+				ph = fmod(ph + 2.0 * M_PI * (CENTRE_TONE + (bit ? shift : -shift) / 2) / SAMPLE_RATE, 2.0 * M_PI);
+				rtty_rx(channel(sin(ph)), spb);
+			}
+		}
+	}
+}
+
+static long mfsk_errors = 0;
+
+static void mfsk_loopback(void)
+{
+	int bits = (tones == 8 ? 3 : 2);
+	int blen = MFSK_BLOCK_LEN(bits, MFSK_DEPTH);
+	int bsym = MFSK_BLOCK_SYMBOLS(bits, MFSK_DEPTH);
+	double spb = (double) SAMPLE_RATE / baud;
+	double t = 0, end = 0, ph = 0;
+	double re[8], im[8], best;
+	uint8_t blk[MFSK_BLOCK_LEN(3, MFSK_DEPTH)];
+	size_t i;
+	int n, k, s, c;
+	
+	/* The firmware sends NUL when idle, pad to a whole block */
+	while(tx_len % blen) tx_put("", 1);
+	
+	for(i = 0; i < tx_len; i += blen)
+	{
+		memset(blk, 0, sizeof(blk));
+		
+		for(n = 0; n < bsym; n++)
+		{
+			s = mfsk_symbol(&tx[i], n, bits, MFSK_DEPTH);
+			end += spb;
+			
+			/* Tones are spaced by the symbol rate. Symbol timing is
+			 * assumed to be known */
+			memset(re, 0, sizeof(re));
+			memset(im, 0, sizeof(im));
+			
+			for(; t < end; t++)
+			{
+				double x, w;
+				
+				ph = fmod(ph + 2.0 * M_PI * (BASE_TONE + s * baud) / SAMPLE_RATE, 2.0 * M_PI);
+				x = channel(sin(ph));
+				
+				for(k = 0; k < tones; k++)
+				{
+					w = 2.0 * M_PI * (BASE_TONE + k * baud) / SAMPLE_RATE * t;
+					re[k] += x * cos(w);
+					im[k] += x * sin(w);
+				}
+			}
+			
+			for(c = 0, best = -1, k = 0; k < tones; k++)
+			{
+				if(re[k] * re[k] + im[k] * im[k] > best)
+				{
+					best = re[k] * re[k] + im[k] * im[k];
+					c = k;
+				}
+			}
+			
+			if(c != s) mfsk_errors++;
+			mfsk_unsymbol(blk, n, c, bits, MFSK_DEPTH);
+		}
+		
+		for(k = 0; k < blen; k++) rx_put(blk[k]);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: loopback [options] image.jpg [image.jpg ...]\n"
+		"       loopback [options] -f stream.bin\n"
+		"\n"
+		"  -f  Read the byte stream from a file instead of encoding images\n"
+		"  -o  Write the demodulated byte stream to a file\n"
+		"  -t  MFSK with 4 or 8 tones, 0 for RTTY (default %d)\n"
+		"  -b  Baud rate (default %d)\n"
+		"  -p  RTTY stop bits, 1, 1.5 or 2 (default %g)\n"
+		"  -D  Telemetry at the rate used while falling, every %d s (default %d s)\n"
+		"  -w  RTTY shift in Hz (default %g)\n"
+		"  -s  SNR in dB, in a 2500 Hz bandwidth (default no noise)\n"
+		"  -F  Rayleigh fading rate in Hz (default 0, no fading)\n"
+		"  -r  Random seed (default 1)\n",
+		tones, baud, stopbits, TLM_PERIOD_DESCENT, TLM_PERIOD, shift);
+}
+
+int main(int argc, char *argv[])
+{
+	ssdvrx_t *txr, *rxr;
+	char *in = NULL, *out = NULL;
+	double airtime;
+	long sent = 0, got = 0, repair = 0;
+	int images = 0, complete = 0, complete_fec = 0;
+	int i, c, seed = 1;
+
+#ifdef MFSK
+	tones = MFSK;
+#endif
+	
+	while((c = getopt(argc, argv, "f:o:t:b:p:Dw:s:F:r:h")) != -1)
+	{
+		switch(c)
+		{
+		case 'f': in = optarg; break;
+		case 'o': out = optarg; break;
+		case 't': tones = atoi(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 'p': stopbits = atof(optarg); break;
+		case 'D': tlm_period = TLM_PERIOD_DESCENT; break;
+		case 'w': shift = atof(optarg); break;
+		case 's': snr = atof(optarg); break;
+		case 'F': fade = atof(optarg); break;
+		case 'r': seed = atoi(optarg); break;
+		default: usage(); return(-1);
+		}
+	}
+	
+	if((tones != 0 && tones != 4 && tones != 8) || baud < 1 || baud > SAMPLE_RATE / 4 ||
+	   stopbits < 1 || (!in && optind == argc))
+	{
+		usage();
+		return(-1);
+	}
+	
+	/* Higher MFSK tones alias */
+	if(tones != 0 && BASE_TONE + (tones - 1) * baud >= SAMPLE_RATE / 2)
+	{
+		fprintf(stderr, "The top tone at %g Hz is above %d Hz, lower the baud rate\n",
+			BASE_TONE + (tones - 1) * baud, SAMPLE_RATE / 2);
+		return(-1);
+	}
+	
+	srand(seed);
+	
+	if(in)
+	{
+		FILE *f = fopen(in, "rb");
+		if(!f)
+		{
+			perror(in);
+			return(-1);
+		}
+		
+		while((c = fgetc(f)) != EOF)
+		{
+			uint8_t b = c;
+			tx_put(&b, 1);
+		}
+		
+		fclose(f);
+	}
+	else
+	{
+		for(i = optind; i < argc; i++)
+			if(tx_image(argv[i], i - optind) != 0) return(-1);
+	}
+	
+	/* One second of idle before the data so the receiver can settle */
+	{
+		size_t l = tx_len, idle = 1.0 / airtime_s(1) + 1;
+		tx = realloc(tx, l + idle);
+		memmove(&tx[idle], tx, l);
+		memset(tx, 0, idle);
+		tx_len += idle;
+	}
+	
+	if(tones == 0) rtty_loopback();
+	else mfsk_loopback();
+	airtime = airtime_s(tx_len);
+	
+	if(out)
+	{
+		FILE *f = fopen(out, "wb");
+		if(!f)
+		{
+			perror(out);
+			return(-1);
+		}
+		
+		fwrite(rx, 1, rx_len, f);
+		fclose(f);
+	}
+	
+	/* What was sent, and what was received */
+	txr = malloc(sizeof(ssdvrx_t));
+	rxr = malloc(sizeof(ssdvrx_t));
+	ssdvrx_init(txr);
+	ssdvrx_init(rxr);
+	ssdvrx_feed(txr, tx, tx_len);
+	ssdvrx_feed(rxr, rx, rx_len);
+	
+	for(i = 0; i < 256; i++)
+	{
+		if(!txr->image[i].present) continue;
+		sent += ssdvrx_count(txr, i);
+		got += ssdvrx_count(rxr, i);
+		images++;
+		if(ssdvrx_count(rxr, i) == ssdvrx_count(txr, i)) complete++;
+	}
+	
+	repair = txr->repair;
+	ssdvrx_recover(rxr);
+	
+	for(i = 0; i < 256; i++)
+		if(txr->image[i].present && ssdvrx_count(rxr, i) == ssdvrx_count(txr, i))
+			complete_fec++;
+	
+	if(tones == 0) printf("RTTY, %d baud, %g stop bits, %g Hz shift", baud, stopbits, shift);
+	else printf("MFSK, %d tones, %d baud, depth %d", tones, baud, MFSK_DEPTH);
+	printf(", SNR %g dB, fading %g Hz\n", snr, fade);
+	
+	printf("airtime %.1f s, bytes sent %lu, received %lu",
+		airtime, (unsigned long) tx_len, (unsigned long) rx_len);
+	if(tones == 0) printf(", framing errors %ld\n", rtty_framing);
+	else printf(", symbol errors %ld\n", mfsk_errors);
+	
+	printf("packets sent %ld (+%ld repair), received %ld (+%ld repair), RS corrected %ld bytes, search misses %ld\n",
+		sent, repair, got, rxr->repair, rxr->corrected, rxr->misses);
+	printf("packet loss %.2f%%, %.2f%% after %ld recovered\n",
+		sent ? 100.0 * (sent - got) / sent : 0,
+		sent ? 100.0 * (sent - got - rxr->recovered) / sent : 0, rxr->recovered);
+	printf("images sent %d, complete %d, %d after recovery, %.1f images/hour\n",
+		images, complete, complete_fec, complete_fec * 3600.0 / airtime);
+	
+	ssdvrx_free(txr);
+	ssdvrx_free(rxr);
+	free(txr);
+	free(rxr);
+	free(tx);
+	free(rx);
+	
+	return(0);
+}
+
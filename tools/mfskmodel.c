@@ -0,0 +1,181 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Host model of the MFSK modem. Random data (or data from a file) is
+ * mapped to symbols with the firmware's mfsk.c, rendered to audio as
+ * it would appear from an SSB receiver, mixed with white noise and
+ * demodulated by picking the strongest tone in each symbol period.
+ * The symbol, bit and byte error rates are reported. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "../config.h"
+#include "../mfsk.h"
+
+#define SAMPLE_RATE (MFSK_SAMPLE_RATE)
+#define BASE_TONE   ((double) MFSK_BASE_TONE)
+
+static double gauss(void)
+{
+	/* Box-Muller */
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return(sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v));
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: mfskmodel [-t tones] [-d depth] [-b baud] [-s snr] [-n bytes] [-r seed] [file]\n"
+		"\n"
+		"  -t  Number of tones, 4 or 8 (default 4)\n"
+		"  -d  Interleaver depth, 1 to 255 (default 1)\n"
+		"  -b  Symbols per second (default 300)\n"
+		"  -s  SNR in dB, in a 2500 Hz bandwidth (default 0)\n"
+		"  -n  Number of random bytes to send if no file is given (default 10000)\n"
+		"  -r  Random seed (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int tones = 4, depth = 1, baud = 300, bytes = 10000, seed = 1;
+	double snr = 0;
+	uint8_t *tx, *rx;
+	uint8_t *blk;
+	int bits, blen, bsym, spb, len, i, j, n, k, c;
+	long serr = 0, berr = 0, byerr = 0, nsym = 0;
+	double sigma, *audio;
+	
+	while((c = getopt(argc, argv, "t:d:b:s:n:r:h")) != -1)
+	{
+		switch(c)
+		{
+		case 't': tones = atoi(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 's': snr = atof(optarg); break;
+		case 'n': bytes = atoi(optarg); break;
+		case 'r': seed = atoi(optarg); break;
+		default: usage(); return(-1);
+		}
+	}
+	
+	if((tones != 4 && tones != 8) || depth < 1 || depth > 255 || baud < 1 || baud > SAMPLE_RATE / 2)
+	{
+		usage();
+		return(-1);
+	}
+	
+	/* Higher tones alias */
+	if(BASE_TONE + (tones - 1) * baud >= SAMPLE_RATE / 2)
+	{
+		fprintf(stderr, "The top tone at %g Hz is above %d Hz, lower the baud rate\n",
+			BASE_TONE + (tones - 1) * baud, SAMPLE_RATE / 2);
+		return(-1);
+	}
+	
+	srand(seed);
+	bits = (tones == 8 ? 3 : 2);
+	blen = MFSK_BLOCK_LEN(bits, depth);
+	bsym = MFSK_BLOCK_SYMBOLS(bits, depth);
+	spb  = SAMPLE_RATE / baud;
+	
+	/* Read the data, padded to a whole number of blocks */
+	tx = malloc(bytes + blen);
+	if(optind < argc)
+	{
+		FILE *f = fopen(argv[optind], "rb");
+		if(!f)
+		{
+			perror(argv[optind]);
+			return(-1);
+		}
+		
+		for(bytes = 0; (c = fgetc(f)) != EOF; bytes++)
+		{
+			tx = realloc(tx, bytes + 1 + blen);
+			tx[bytes] = c;
+		}
+		
+		fclose(f);
+	}
+	else for(i = 0; i < bytes; i++) tx[i] = rand();
+	
+	len = (bytes + blen - 1) / blen * blen;
+	memset(&tx[bytes], 0, len - bytes);
+	rx = calloc(len, 1);
+	audio = malloc(sizeof(double) * spb);
+	
+	/* Noise level for the SNR in 2500 Hz, the tone has a power of 0.5 */
+	sigma = sqrt(0.5 / pow(10, snr / 10.0) * (SAMPLE_RATE / 2) / 2500.0);
+	
+	for(i = 0; i < len; i += blen)
+	{
+		blk = &rx[i];
+		
+		for(n = 0; n < bsym; n++)
+		{
+			int s = mfsk_symbol(&tx[i], n, bits, depth);
+			int best = 0;
+			double bestp = -1;
+			
+			/* Render the symbol with noise. Tones are spaced by the
+			 * symbol rate so they are orthogonal over one symbol */
+			for(j = 0; j < spb; j++)
+				audio[j] = sin(2.0 * M_PI * (BASE_TONE + s * baud) * j / SAMPLE_RATE)
+				         + sigma * gauss();
+			
+			/* Non-coherent detection, the strongest tone wins */
+			for(k = 0; k < tones; k++)
+			{
+				double re = 0, im = 0, w = 2.0 * M_PI * (BASE_TONE + k * baud) / SAMPLE_RATE;
+				for(j = 0; j < spb; j++)
+				{
+					re += audio[j] * cos(w * j);
+					im += audio[j] * sin(w * j);
+				}
+				
+				if(re * re + im * im > bestp)
+				{
+					bestp = re * re + im * im;
+					best = k;
+				}
+			}
+			
+			if(best != s) serr++;
+			nsym++;
+			
+			mfsk_unsymbol(blk, n, best, bits, depth);
+		}
+	}
+	
+	for(i = 0; i < bytes; i++)
+	{
+		uint8_t x = tx[i] ^ rx[i];
+		if(x) byerr++;
+		for(; x; x >>= 1) berr += x & 1;
+	}
+	
+	printf("tones %d, depth %d, %d baud (%d bit/s), SNR %.1f dB\n",
+		tones, depth, baud, baud * bits, snr);
+	printf("symbols %ld, errors %ld (%.2e)\n", nsym, serr, (double) serr / nsym);
+	printf("bits %ld, errors %ld (%.2e)\n", (long) bytes * 8, berr, (double) berr / (bytes * 8.0));
+	printf("bytes %d, errors %ld (%.2e)\n", bytes, byerr, (double) byerr / bytes);
+	
+	free(tx);
+	free(rx);
+	free(audio);
+	
+	return(0);
+}
+
@@ -0,0 +1,160 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* File backed MMC / SD card, see mmcfile.h */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../mmc.h"
+#include "mmcfile.h"
+
+long mmcfile_reads, mmcfile_writes;
+
+static FILE *f = NULL;
+static uint32_t size;
+
+static char writing = 0;
+static uint32_t wr_block;
+static uint16_t wr_pos;
+static uint8_t wr_buf[MMC_BLOCK];
+
+int mmcfile_open(const char *path, uint32_t blocks)
+{
+	mmcfile_close();
+	
+	f = fopen(path, "r+b");
+	if(!f) f = fopen(path, "w+b");
+	if(!f)
+	{
+		perror(path);
+		return(-1);
+	}
+	
+	size = blocks;
+	writing = 0;
+	mmcfile_reads = mmcfile_writes = 0;
+	
+	return(0);
+}
+
+void mmcfile_close(void)
+{
+	if(f) fclose(f);
+	f = NULL;
+}
+
+char mmc_init(void)
+{
+	writing = 0;
+	return(f ? 0 : -1);
+}
+
+char mmc_read(uint32_t block, uint16_t offset, uint8_t *dst, uint16_t length)
+{
+	uint8_t b[MMC_BLOCK];
+	
+	if(!f) return(-2);
+	if(writing) return(-1);
+	if(size && block >= size) return(-2);
+	if(offset > MMC_BLOCK || length > MMC_BLOCK - offset) return(-4);
+	
+	/* Past the end of the file is zeros */
+	memset(b, 0, MMC_BLOCK);
+	fseek(f, (long) block * MMC_BLOCK, SEEK_SET);
+	if(fread(b, 1, MMC_BLOCK, f) < MMC_BLOCK) clearerr(f);
+	
+	memcpy(dst, b + offset, length);
+	mmcfile_reads++;
+	
+	return(0);
+}
+
+char mmc_write_start(uint32_t block)
+{
+	if(!f) return(-2);
+	if(writing) return(-1);
+	if(size && block >= size) return(-2);
+	
+	writing = 1;
+	wr_block = block;
+	wr_pos = 0;
+	
+	return(0);
+}
+
+static char mmcfile_flush(void)
+{
+	if(size && wr_block >= size)
+	{
+		writing = 0;
+		return(-3);
+	}
+	
+	if(fseek(f, (long) wr_block * MMC_BLOCK, SEEK_SET) != 0 ||
+	   fwrite(wr_buf, 1, MMC_BLOCK, f) != MMC_BLOCK)
+	{
+		writing = 0;
+		return(-4);
+	}
+	
+	fflush(f);
+	mmcfile_writes++;
+	wr_block++;
+	wr_pos = 0;
+	
+	return(0);
+}
+
+char mmc_write(const uint8_t *src, uint16_t length)
+{
+	uint16_t n;
+	char r;
+	
+	if(!writing) return(-1);
+	
+	while(length > 0)
+	{
+		n = MMC_BLOCK - wr_pos;
+		if(n > length) n = length;
+		
+		memcpy(wr_buf + wr_pos, src, n);
+		wr_pos += n;
+		src += n;
+		length -= n;
+		
+		if(wr_pos == MMC_BLOCK && (r = mmcfile_flush()) != 0) return(r);
+	}
+	
+	return(0);
+}
+
+char mmc_write_stop(void)
+{
+	char r;
+	
+	if(!writing) return(-1);
+	
+	/* Pad out the last block */
+	if(wr_pos > 0)
+	{
+		memset(wr_buf + wr_pos, 0, MMC_BLOCK - wr_pos);
+		if((r = mmcfile_flush()) != 0) return(r);
+	}
+	
+	writing = 0;
+	
+	return(0);
+}
+
+char mmc_writing(void)
+{
+	return(writing);
+}
+
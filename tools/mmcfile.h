@@ -0,0 +1,30 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* A card image file in place of the MMC / SD card, for the host tools.
+ * tools/mmcfile.c provides the functions of mmc.h, and is built
+ * instead of mmc.c. Blocks past the end of the file read as zeros.
+ * Writes behave as the card's do: data goes out a block at a time as
+ * each fills, and a card of a given size rejects writes past its end. */
+
+#ifndef INC_MMCFILE_H
+#define INC_MMCFILE_H
+
+#include <stdint.h>
+
+/* Use the image file at path, created if needed. blocks is the size of
+ * the card, 0 for no limit */
+extern int mmcfile_open(const char *path, uint32_t blocks);
+extern void mmcfile_close(void);
+
+/* Blocks read and written so far */
+extern long mmcfile_reads, mmcfile_writes;
+
+#endif
+
@@ -0,0 +1,207 @@
+/* Reed-Solomon decoder
+ * Copyright 2002, Phil Karn, KA9Q
+ * May be used under the terms of the GNU Lesser General Public License (LGPL)
+ * 
+ * Host-side companion to rs8encode.c, using the same tables
+ * 
+ */
+
+#include <string.h>
+#include "rs8decode.h"
+
+#define NN     (255)
+#define FCR    (112)
+#define PRIM   (11)
+#define IPRIM  (116)
+#define A0     (NN)
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+/* From rs8encode.c */
+extern const uint8_t alpha_to[];
+extern const uint8_t index_of[];
+
+static int modnn(int x)
+{
+	while(x >= NN)
+	{
+		x -= NN;
+		x = (x >> 8) + (x & NN);
+	}
+	return(x);
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if(a == 0 || b == 0) return(0);
+	return(alpha_to[modnn(index_of[a] + index_of[b])]);
+}
+
+int decode_rs_8(uint8_t *data, int pad, int nroots)
+{
+	int deg_lambda, el, deg_omega;
+	int i, j, r, k;
+	int u, q, tmp, num1, num2, den, discr_r;
+	int lambda[33], s[32], b[33], t[33], omega[33];
+	int root[32], reg[33], loc[32];
+	int syn_error, count;
+	
+	if(nroots != 32 && nroots != 16 && nroots != 8) return(-1);
+	
+	/* Form the syndromes */
+	for(i = 0; i < nroots; i++) s[i] = data[0];
+	
+	for(j = 1; j < NN - pad; j++)
+	{
+		for(i = 0; i < nroots; i++)
+		{
+			if(s[i] == 0) s[i] = data[j];
+			else s[i] = data[j] ^ alpha_to[modnn(index_of[s[i]] + (FCR + i) * PRIM)];
+		}
+	}
+	
+	/* Convert syndromes to index form, checking for nonzero condition */
+	syn_error = 0;
+	for(i = 0; i < nroots; i++)
+	{
+		syn_error |= s[i];
+		s[i] = index_of[s[i]];
+	}
+	
+	/* No errors */
+	if(!syn_error) return(0);
+	
+	/* Berlekamp-Massey */
+	memset(lambda, 0, sizeof(lambda));
+	lambda[0] = 1;
+	
+	for(i = 0; i < nroots + 1; i++) b[i] = index_of[lambda[i]];
+	
+	r = 0;
+	el = 0;
+	while(++r <= nroots)
+	{
+		/* Compute discrepancy at the r-th step in poly-form */
+		discr_r = 0;
+		for(i = 0; i < r; i++)
+		{
+			if((lambda[i] != 0) && (s[r - i - 1] != A0))
+				discr_r ^= alpha_to[modnn(index_of[lambda[i]] + s[r - i - 1])];
+		}
+		
+		discr_r = index_of[discr_r];
+		if(discr_r == A0)
+		{
+			/* B(x) <-- x*B(x) */
+			memmove(&b[1], b, nroots * sizeof(b[0]));
+			b[0] = A0;
+		}
+		else
+		{
+			/* T(x) <-- lambda(x) - discr_r*x*b(x) */
+			t[0] = lambda[0];
+			for(i = 0; i < nroots; i++)
+			{
+				if(b[i] != A0) t[i + 1] = lambda[i + 1] ^ alpha_to[modnn(discr_r + b[i])];
+				else t[i + 1] = lambda[i + 1];
+			}
+			
+			if(2 * el <= r - 1)
+			{
+				el = r - el;
+				
+				/* B(x) <-- inv(discr_r) * lambda(x) */
+				for(i = 0; i <= nroots; i++)
+					b[i] = (lambda[i] == 0) ? A0 : modnn(index_of[lambda[i]] - discr_r + NN);
+			}
+			else
+			{
+				/* B(x) <-- x*B(x) */
+				memmove(&b[1], b, nroots * sizeof(b[0]));
+				b[0] = A0;
+			}
+			
+			memcpy(lambda, t, (nroots + 1) * sizeof(t[0]));
+		}
+	}
+	
+	/* Convert lambda to index form and compute deg(lambda(x)) */
+	deg_lambda = 0;
+	for(i = 0; i < nroots + 1; i++)
+	{
+		lambda[i] = index_of[lambda[i]];
+		if(lambda[i] != A0) deg_lambda = i;
+	}
+	
+	/* Find roots of the error locator polynomial by Chien search */
+	memcpy(&reg[1], &lambda[1], nroots * sizeof(reg[0]));
+	count = 0;
+	for(i = 1, k = IPRIM - 1; i <= NN; i++, k = modnn(k + IPRIM))
+	{
+		q = 1; /* lambda[0] is always 0 */
+		for(j = deg_lambda; j > 0; j--)
+		{
+			if(reg[j] != A0)
+			{
+				reg[j] = modnn(reg[j] + j);
+				q ^= alpha_to[reg[j]];
+			}
+		}
+		
+		if(q != 0) continue; /* Not a root */
+		
+		root[count] = i;
+		loc[count] = k;
+		
+		/* If we've already found max possible roots, abort the search */
+		if(++count == deg_lambda) break;
+	}
+	
+	/* deg(lambda) unequal to number of roots => uncorrectable error */
+	if(deg_lambda != count || count == 0) return(-1);
+	
+	/* Compute err+eras evaluator poly omega(x) = s(x)*lambda(x) (modulo
+	 * x**nroots). in index form. Also find deg(omega) */
+	deg_omega = deg_lambda - 1;
+	for(i = 0; i <= deg_omega; i++)
+	{
+		tmp = 0;
+		for(j = i; j >= 0; j--)
+		{
+			if((s[i - j] != A0) && (lambda[j] != A0))
+				tmp ^= alpha_to[modnn(s[i - j] + lambda[j])];
+		}
+		omega[i] = index_of[tmp];
+	}
+	
+	/* Compute error values in poly-form */
+	for(j = count - 1; j >= 0; j--)
+	{
+		num1 = 0;
+		for(i = deg_omega; i >= 0; i--)
+		{
+			if(omega[i] != A0)
+				num1 ^= alpha_to[modnn(omega[i] + i * root[j])];
+		}
+		
+		num2 = alpha_to[modnn(root[j] * (FCR - 1) + NN)];
+		den = 0;
+		
+		/* lambda[i+1] for i even is the formal derivative lambda_pr of lambda[i] */
+		for(i = MIN(deg_lambda, nroots - 1) & ~1; i >= 0; i -= 2)
+		{
+			if(lambda[i + 1] != A0)
+				den ^= alpha_to[modnn(lambda[i + 1] + i * root[j])];
+		}
+		
+		/* Apply error to data */
+		if(num1 != 0 && loc[j] >= pad)
+		{
+			u = alpha_to[modnn(index_of[num1] + index_of[num2] + NN - index_of[den])];
+			data[loc[j] - pad] ^= u;
+		}
+	}
+	
+	return(count);
+}
+
@@ -0,0 +1,17 @@
+/* Reed-Solomon decoder
+ * Copyright 2002, Phil Karn, KA9Q
+ * May be used under the terms of the GNU Lesser General Public License (LGPL)
+ * 
+ * Host-side companion to rs8encode.c, using the same tables
+ * 
+ */
+
+#include <stdint.h>
+
+/* Returns the number of corrected bytes, or -1 if uncorrectable.
+ * nroots may be 32, 16 or 8 */
+extern int decode_rs_8(uint8_t *data, int pad, int nroots);
+
+/* GF(2^8) multiply with the encoder's tables, see also rs8_inv() */
+extern uint8_t gf_mul(uint8_t a, uint8_t b);
+
@@ -0,0 +1,161 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Reads and writes the record log of a card image, with the firmware's
+ * sdlog.c. The image may be a copy of a card from a flight, made with
+ * dd, or one being prepared for the host tools. With no options the
+ * records are listed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "../mmc.h"
+#include "../sdlog.h"
+#include "mmcfile.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: sdcat [options] card.img [file ...]\n"
+		"\n"
+		"  -F  Begin a new, empty log\n"
+		"  -w  Append each file as a record of this type\n"
+		"  -i  ID of the first record appended, then counting up (default 0)\n"
+		"  -x  Write the data of record number n to stdout\n"
+		"  -s  Size of the card in blocks (default no limit)\n");
+}
+
+static int append(const char *path, uint8_t type, uint16_t id)
+{
+	uint8_t buf[4096];
+	long length;
+	size_t n;
+	FILE *f;
+	char r;
+	
+	f = fopen(path, "rb");
+	if(!f)
+	{
+		perror(path);
+		return(-1);
+	}
+	
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	rewind(f);
+	
+	r = sdlog_begin(type, id, length);
+	while(r == 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+		r = sdlog_write(buf, n);
+	if(r == 0) r = sdlog_end();
+	
+	fclose(f);
+	
+	if(r != 0)
+	{
+		fprintf(stderr, "%s: Write failed (%i)\n", path, r);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static int extract(uint32_t seq)
+{
+	uint8_t buf[MMC_BLOCK];
+	sdlog_rec_t rec;
+	uint32_t o, n;
+	char r;
+	
+	for(r = sdlog_first(&rec); r == 0 && rec.seq != seq; r = sdlog_next(&rec));
+	if(r != 0)
+	{
+		fprintf(stderr, "Record %u not found\n", seq);
+		return(-1);
+	}
+	
+	for(o = 0; o < rec.length; o += n)
+	{
+		n = rec.length - o;
+		if(n > sizeof(buf)) n = sizeof(buf);
+		
+		if((r = sdlog_read(&rec, o, buf, n)) != 0)
+		{
+			fprintf(stderr, "Read failed (%i)\n", r);
+			return(-1);
+		}
+		
+		fwrite(buf, 1, n, stdout);
+	}
+	
+	return(0);
+}
+
+int main(int argc, char *argv[])
+{
+	int format = 0, type = 0, id = 0, c, i;
+	long seq = -1, blocks = 0;
+	sdlog_rec_t rec;
+	char r;
+	
+	while((c = getopt(argc, argv, "Fw:i:x:s:h")) != -1)
+	{
+		switch(c)
+		{
+		case 'F': format = 1; break;
+		case 'w': type = atoi(optarg); break;
+		case 'i': id = atoi(optarg); break;
+		case 'x': seq = atol(optarg); break;
+		case 's': blocks = atol(optarg); break;
+		default: usage(); return(-1);
+		}
+	}
+	
+	if(optind == argc || (type == 0 && optind + 1 != argc))
+	{
+		usage();
+		return(-1);
+	}
+	
+	if(mmcfile_open(argv[optind], blocks) != 0) return(-1);
+	
+	if((r = sdlog_init()) != 0)
+	{
+		fprintf(stderr, "sdlog_init() failed (%i)\n", r);
+		return(-1);
+	}
+	
+	if(format && (r = sdlog_format()) != 0)
+	{
+		fprintf(stderr, "sdlog_format() failed (%i)\n", r);
+		return(-1);
+	}
+	
+	for(i = optind + 1; i < argc; i++)
+		if(append(argv[i], type, id++) != 0) return(-1);
+	
+	if(seq >= 0) return(extract(seq));
+	
+	/* List the records */
+	for(r = sdlog_first(&rec); r == 0; r = sdlog_next(&rec))
+	{
+		printf("%6u  block %-8u type %-3u id %-5u %u bytes\n",
+			rec.seq, rec.block, rec.type, rec.id, rec.length);
+	}
+	
+	if(r < 0) fprintf(stderr, "Read failed (%i)\n", r);
+	printf("%u records\n", sdlog_count());
+	
+	mmcfile_close();
+	
+	return(0);
+}
+
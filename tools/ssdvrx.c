@@ -0,0 +1,339 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ssdvrx.h"
+#include "rs8decode.h"
+#include "../rs8.h"
+
+static uint32_t crc32(const uint8_t *d, size_t length)
+{
+	uint32_t crc, x;
+	int i;
+	
+	for(crc = 0xFFFFFFFF; length; length--)
+	{
+		x = (crc ^ *(d++)) & 0xFF;
+		for(i = 8; i > 0; i--)
+		{
+			if(x & 1) x = (x >> 1) ^ 0xEDB88320;
+			else x >>= 1;
+		}
+		crc = (crc >> 8) ^ x;
+	}
+	
+	return(crc ^ 0xFFFFFFFF);
+}
+
+static int type_rscodes(uint8_t type)
+{
+	switch(type)
+	{
+	case SSDV_TYPE_NORMAL:     case SSDV_TYPE_REPAIR:     return(32);
+	case SSDV_TYPE_NORMAL + 2: case SSDV_TYPE_REPAIR + 2: return(16);
+	case SSDV_TYPE_NORMAL + 4: case SSDV_TYPE_REPAIR + 4: return(8);
+	}
+	
+	return(-1);
+}
+
+static int payload_size(int rscodes)
+{
+	return(SSDV_PKT_SIZE - SSDV_PKT_SIZE_HEADER - SSDV_PKT_SIZE_CRC - rscodes);
+}
+
+static void fec(uint8_t *pkt, int rscodes)
+{
+	int i = SSDV_PKT_SIZE_HEADER + payload_size(rscodes) - 1;
+	uint32_t x = crc32(&pkt[1], i);
+	
+	i++;
+	pkt[i++] = x >> 24;
+	pkt[i++] = x >> 16;
+	pkt[i++] = x >> 8;
+	pkt[i++] = x;
+	
+	encode_rs_8(&pkt[1], &pkt[i], 0, rscodes);
+}
+
+static int try_check(uint8_t *pkt, int rscodes, int *corrected)
+{
+	uint8_t tmp[SSDV_PKT_SIZE];
+	uint32_t x;
+	int i, n;
+	
+	memcpy(tmp, pkt, SSDV_PKT_SIZE);
+	
+	n = decode_rs_8(&tmp[1], 0, rscodes);
+	if(n < 0) return(-1);
+	
+	/* The corrected type must agree with the number of RS codes */
+	if(type_rscodes(tmp[1]) != rscodes) return(-1);
+	
+	i = SSDV_PKT_SIZE_HEADER + payload_size(rscodes) - 1;
+	x = crc32(&tmp[1], i);
+	i++;
+	if(tmp[i] != (uint8_t) (x >> 24) || tmp[i + 1] != (uint8_t) (x >> 16) ||
+	   tmp[i + 2] != (uint8_t) (x >> 8) || tmp[i + 3] != (uint8_t) x)
+		return(-1);
+	
+	tmp[0] = 0x55;
+	memcpy(pkt, tmp, SSDV_PKT_SIZE);
+	if(corrected) *corrected = n;
+	
+	return(rscodes);
+}
+
+int ssdvrx_check(uint8_t *pkt, int *corrected)
+{
+	int r = type_rscodes(pkt[1]);
+	
+	/* Use the type if it arrived intact, otherwise try each size */
+	if(r > 0) return(try_check(pkt, r, corrected));
+	
+	if(try_check(pkt, 32, corrected) > 0) return(32);
+	if(try_check(pkt, 16, corrected) > 0) return(16);
+	if(try_check(pkt, 8, corrected) > 0) return(8);
+	
+	return(-1);
+}
+
+void ssdvrx_init(ssdvrx_t *r)
+{
+	int i;
+	
+	memset(r, 0, sizeof(ssdvrx_t));
+	for(i = 0; i < 256; i++) r->image[i].last = -1;
+}
+
+void ssdvrx_free(ssdvrx_t *r)
+{
+	ssdvrx_image_t *img;
+	int i, j;
+	
+	for(i = 0; i < 256; i++)
+	{
+		img = &r->image[i];
+		for(j = 0; j < SSDVRX_MAX_PACKETS; j++) free(img->pkt[j]);
+		for(j = 0; j < img->rp_count; j++) free(img->rp[j]);
+	}
+	
+	ssdvrx_init(r);
+}
+
+int ssdvrx_add(ssdvrx_t *r, const uint8_t *pkt)
+{
+	ssdvrx_image_t *img = &r->image[pkt[6]];
+	uint8_t *p;
+	int id, i;
+	
+	if(!img->present)
+	{
+		img->present = 1;
+		img->width = img->height = 0;
+	}
+	
+	if((pkt[1] - SSDV_TYPE_NORMAL) & 1)
+	{
+		/* Repair packet, ignore duplicates */
+		for(i = 0; i < img->rp_count; i++)
+			if(!memcmp(img->rp[i], pkt, SSDV_PKT_OFFSET_REPAIR)) return(-1);
+		
+		if(img->rp_count == SSDVRX_MAX_REPAIR) return(-1);
+		
+		p = malloc(SSDV_PKT_SIZE);
+		memcpy(p, pkt, SSDV_PKT_SIZE);
+		img->rp[img->rp_count++] = p;
+		r->repair++;
+		
+		return(0);
+	}
+	
+	r->packets++;
+	
+	id = (pkt[7] << 8) | pkt[8];
+	if(id >= SSDVRX_MAX_PACKETS || img->pkt[id]) return(-1);
+	
+	p = malloc(SSDV_PKT_SIZE);
+	memcpy(p, pkt, SSDV_PKT_SIZE);
+	img->pkt[id] = p;
+	
+	if(id > img->last) img->last = id;
+	img->width = pkt[9] << 4;
+	img->height = pkt[10] << 4;
+	
+	return(0);
+}
+
+void ssdvrx_feed(ssdvrx_t *r, const uint8_t *data, size_t length)
+{
+	uint8_t pkt[SSDV_PKT_SIZE];
+	int n;
+	
+	for(; length; length--)
+	{
+		r->win[r->wlen++] = *(data++);
+		if(r->wlen < SSDV_PKT_SIZE) continue;
+		
+		/* Only try the RS decoder if the sync or type byte is intact */
+		if(r->win[0] == 0x55 || type_rscodes(r->win[1]) > 0)
+		{
+			memcpy(pkt, r->win, SSDV_PKT_SIZE);
+			if(ssdvrx_check(pkt, &n) > 0)
+			{
+				r->corrected += n;
+				ssdvrx_add(r, pkt);
+				r->wlen = 0;
+				continue;
+			}
+			
+			r->misses++;
+		}
+		
+		memmove(r->win, &r->win[1], --r->wlen);
+	}
+}
+
+/* Solve the Cauchy system for one repair group. rp[] holds the repair
+ * packets to use, one for each missing packet in miss[] */
+static int recover_group(ssdvrx_image_t *img, uint8_t **rp, int *miss, int n, int first, int group)
+{
+	uint8_t a[64][64], x[64][SSDV_PKT_SIZE];
+	uint8_t *pkt, c;
+	int rscodes, len, i, j, k, mode = -1;
+	
+	rscodes = type_rscodes(rp[0][1]);
+	len = SSDV_PKT_SIZE_HEADER + payload_size(rscodes) - SSDV_PKT_OFFSET_REPAIR;
+	
+	/* Subtract the packets we have from each repair packet */
+	for(j = 0; j < n; j++)
+	{
+		uint8_t rj = rp[j][10];
+		
+		memcpy(x[j], &rp[j][SSDV_PKT_OFFSET_REPAIR], len);
+		
+		for(i = 0; i < group; i++)
+		{
+			pkt = img->pkt[first + i];
+			if(!pkt) continue;
+			rs8_mac(x[j], &pkt[SSDV_PKT_OFFSET_REPAIR], len, rs8_inv(i ^ (0xFF - rj)));
+			mode = pkt[11];
+		}
+		
+		for(k = 0; k < n; k++)
+			a[j][k] = rs8_inv(miss[k] ^ (0xFF - rj));
+	}
+	
+	/* Gaussian elimination */
+	for(k = 0; k < n; k++)
+	{
+		for(j = k; j < n && a[j][k] == 0; j++);
+		if(j == n) return(0);
+		
+		if(j != k)
+		{
+			uint8_t t[SSDV_PKT_SIZE];
+			for(i = 0; i < n; i++) { c = a[j][i]; a[j][i] = a[k][i]; a[k][i] = c; }
+			memcpy(t, x[j], len); memcpy(x[j], x[k], len); memcpy(x[k], t, len);
+		}
+		
+		c = rs8_inv(a[k][k]);
+		for(i = 0; i < n; i++) a[k][i] = gf_mul(a[k][i], c);
+		for(i = 0; i < len; i++) x[k][i] = gf_mul(x[k][i], c);
+		
+		for(j = 0; j < n; j++)
+		{
+			if(j == k || a[j][k] == 0) continue;
+			c = a[j][k];
+			for(i = 0; i < n; i++) a[j][i] ^= gf_mul(a[k][i], c);
+			rs8_mac(x[j], x[k], len, c);
+		}
+	}
+	
+	/* MCU mode isn't covered by the repair data, take it from any packet */
+	for(i = 0; mode < 0 && i < SSDVRX_MAX_PACKETS; i++)
+		if(img->pkt[i]) mode = img->pkt[i][11];
+	
+	/* Rebuild the lost packets */
+	for(k = 0; k < n; k++)
+	{
+		int id = first + miss[k];
+		
+		pkt = malloc(SSDV_PKT_SIZE);
+		memcpy(pkt, rp[0], 7);
+		pkt[0]  = 0x55;
+		pkt[1]  = rp[0][1] - 1;
+		pkt[7]  = id >> 8;
+		pkt[8]  = id & 0xFF;
+		pkt[9]  = img->width >> 4;
+		pkt[10] = img->height >> 4;
+		pkt[11] = mode < 0 ? 0 : mode;
+		memcpy(&pkt[SSDV_PKT_OFFSET_REPAIR], x[k], len);
+		fec(pkt, rscodes);
+		
+		img->pkt[id] = pkt;
+		if(id > img->last) img->last = id;
+	}
+	
+	return(n);
+}
+
+int ssdvrx_recover(ssdvrx_t *r)
+{
+	ssdvrx_image_t *img;
+	uint8_t *use[64];
+	int miss[64];
+	int i, j, k, n, u, first, group, count = 0;
+	
+	for(i = 0; i < 256; i++)
+	{
+		img = &r->image[i];
+		
+		for(j = 0; j < img->rp_count; j++)
+		{
+			first = (img->rp[j][7] << 8) | img->rp[j][8];
+			group = img->rp[j][9];
+			
+			/* Only handle each group once, at its first repair packet */
+			for(k = 0; k < j; k++)
+				if(!memcmp(img->rp[k] + 7, img->rp[j] + 7, 3)) break;
+			if(k < j) continue;
+			
+			if(first + group > SSDVRX_MAX_PACKETS || group > 64) continue;
+			
+			for(n = 0, k = 0; k < group; k++)
+				if(!img->pkt[first + k]) miss[n++] = k;
+			if(n == 0) continue;
+			
+			/* Gather the repair packets for this group */
+			for(u = 0, k = j; k < img->rp_count && u < n; k++)
+				if(!memcmp(img->rp[k] + 7, img->rp[j] + 7, 3)) use[u++] = img->rp[k];
+			if(u < n) continue;
+			
+			count += recover_group(img, use, miss, n, first, group);
+		}
+	}
+	
+	r->recovered += count;
+	
+	return(count);
+}
+
+int ssdvrx_count(ssdvrx_t *r, uint8_t image_id)
+{
+	ssdvrx_image_t *img = &r->image[image_id];
+	int i, n;
+	
+	for(i = n = 0; i <= img->last; i++)
+		if(img->pkt[i]) n++;
+	
+	return(n);
+}
+
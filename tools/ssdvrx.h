@@ -0,0 +1,76 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Host-side SSDV packet receiver for the test tools. Finds packets in
+ * a byte stream, corrects them with the RS codes, checks the CRC and
+ * keeps every good packet so lost ones can be rebuilt from the repair
+ * packets. Only the packet layer is handled, not the JPEG. */
+
+#ifndef INC_SSDVRX_H
+#define INC_SSDVRX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../ssdv.h"
+
+#define SSDVRX_MAX_PACKETS (4096)
+#define SSDVRX_MAX_REPAIR  (1024)
+
+typedef struct
+{
+	int present;
+	int width, height; /* In pixels, from the first packet seen */
+	int last;          /* Highest packet ID seen, -1 if none     */
+	uint8_t *pkt[SSDVRX_MAX_PACKETS];
+	uint8_t *rp[SSDVRX_MAX_REPAIR];
+	int rp_count;
+} ssdvrx_image_t;
+
+typedef struct
+{
+	/* Stream search window */
+	uint8_t win[SSDV_PKT_SIZE];
+	int wlen;
+	
+	/* Images, indexed by image ID */
+	ssdvrx_image_t image[256];
+	
+	/* Counters */
+	long packets;      /* Good image packets, including duplicates */
+	long repair;       /* Good repair packets                      */
+	long recovered;    /* Image packets rebuilt from repair data   */
+	long corrected;    /* Bytes corrected by the RS decoder        */
+	
+	/* Search offsets where a sync or type byte looked valid but no
+	 * packet decoded. Most are data bytes, not damaged packets */
+	long misses;
+} ssdvrx_t;
+
+/* Checks and corrects a single packet in place. Returns the number of
+ * RS codes used by the packet, or -1 if it is not valid */
+extern int ssdvrx_check(uint8_t *pkt, int *corrected);
+
+extern void ssdvrx_init(ssdvrx_t *r);
+extern void ssdvrx_free(ssdvrx_t *r);
+
+/* Feed received bytes, any packets found are checked and stored */
+extern void ssdvrx_feed(ssdvrx_t *r, const uint8_t *data, size_t length);
+
+/* Store a packet that has already been checked, returns 0 if it was new */
+extern int ssdvrx_add(ssdvrx_t *r, const uint8_t *pkt);
+
+/* Rebuild lost image packets from the repair packets received.
+ * Returns the number of packets recovered */
+extern int ssdvrx_recover(ssdvrx_t *r);
+
+/* Number of packets received for an image, after any recovery */
+extern int ssdvrx_count(ssdvrx_t *r, uint8_t image_id);
+
+#endif
+
@@ -0,0 +1,20 @@
+/* hadie - High Altitude Balloon flight software              */
+/*============================================================*/
+/* Copyright (C)2010 Philip Heron <phil@sanslogic.co.uk>      */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* Stand-in for avr-libc's atomic.h. The host tools are single threaded
+ * and interrupts only happen while sleeping, so the block just runs. */
+
+#ifndef INC_HOST_ATOMIC_H
+#define INC_HOST_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for(int _atomic = 1; _atomic; _atomic = 0)
+
+#endif
+